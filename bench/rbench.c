@@ -0,0 +1,866 @@
+/*------------------------------------------------------------------------------
+ *
+ * Copyright (c) 2016-Present Pivotal Software, Inc
+ *
+ *------------------------------------------------------------------------------
+ */
+
+/*
+ * End-to-end call benchmark. Starts the R client and plays the backend side
+ * of the connection: sends synthetic call requests, answers SPI statements
+ * with a canned result and reports calls/s and latency percentiles for each
+ * scenario.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "common/comm_channel.h"
+#include "common/comm_utils.h"
+#include "common/comm_connectivity.h"
+#include "rshm.h"
+
+#ifndef UNUSED
+#define UNUSED __attribute__ (( unused ))
+#endif
+
+#define DEFAULT_CLIENT_CMD "bin/rclient"
+#define DEFAULT_PORT 8080
+#define CONNECT_TIMEOUT_MS 10000
+#define DEFAULT_SHM_THRESHOLD (1024 * 1024)
+
+typedef struct bench_options {
+	const char *client_cmd;
+	const char *uds_path;
+	const char *scenarios;
+	int port;
+	int calls;
+	int warmup;
+	int array_size;
+	int setof_rows;
+	int spi_queries;
+	int spi_rows;
+	int bytea_size;
+	int shm_mb;
+	int chunked;
+} bench_options;
+
+typedef struct bench_array {
+	plcIterator iter;
+	plcArrayMeta meta;
+	int dims[1];
+	double *values;
+	int pos;
+} bench_array;
+
+typedef struct bench_scenario {
+	const char *name;
+	void (*init)(plcMsgCallreq *req, bench_options *opts);
+} bench_scenario;
+
+static bench_options options;
+
+static plcType type_int4 = {PLC_DATA_INT4, 0, "int4", NULL};
+static plcType type_float8 = {PLC_DATA_FLOAT8, 0, "float8", NULL};
+static plcType type_text = {PLC_DATA_TEXT, 0, "text", NULL};
+static plcType type_bytea = {PLC_DATA_BYTEA, 0, "bytea", NULL};
+
+/* canned answer to every SPI statement */
+static plcMsgResult *spi_result = NULL;
+
+/* region offered to the client, the first half carries our values */
+static char *shm_base = NULL;
+static size_t shm_half = 0;
+
+/* bytea results are copied out like the backend does */
+static char *bytea_copy = NULL;
+
+static double clock_us(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double) ts.tv_sec * 1000000.0 + (double) ts.tv_nsec / 1000.0;
+}
+
+static void set_argument(plcArgument *arg, char *name, plcType *type, void *value) {
+	arg->name = name;
+	arg->type = *type;
+	arg->data.isnull = 0;
+	arg->data.value = (char *) value;
+}
+
+/* Array elements are freed by the channel once they are sent */
+static rawdata *bench_array_next(plcIterator *iter) {
+	bench_array *arr = (bench_array *) iter->payload;
+	rawdata *res;
+
+	res = (rawdata *) pmalloc(sizeof(rawdata));
+	res->isnull = 0;
+	res->value = pmalloc(sizeof(double));
+	memcpy(res->value, &arr->values[arr->pos], sizeof(double));
+	arr->pos += 1;
+
+	return res;
+}
+
+static void bench_array_rewind(plcIterator *iter) {
+	bench_array *arr = (bench_array *) iter->payload;
+
+	arr->pos = 0;
+}
+
+static plcIterator *new_bench_array(int size) {
+	bench_array *arr = (bench_array *) pmalloc(sizeof(bench_array));
+	int i;
+
+	arr->values = (double *) pmalloc(sizeof(double) * size);
+	for (i = 0; i < size; i++) {
+		arr->values[i] = i * 0.5;
+	}
+	arr->pos = 0;
+	arr->dims[0] = size;
+	arr->meta.type = PLC_DATA_FLOAT8;
+	arr->meta.ndims = 1;
+	arr->meta.dims = arr->dims;
+	arr->meta.size = size;
+
+	memset(&arr->iter, 0, sizeof(plcIterator));
+	arr->iter.meta = &arr->meta;
+	arr->iter.payload = (char *) arr;
+	arr->iter.next = bench_array_next;
+	arr->iter.cleanup = bench_array_rewind;
+
+	return &arr->iter;
+}
+
+static plcType *new_array_type(plcType *elem) {
+	plcType *type = (plcType *) pmalloc(sizeof(plcType));
+
+	type->type = PLC_DATA_ARRAY;
+	type->nSubTypes = 1;
+	type->typeName = "float8[]";
+	type->subTypes = elem;
+	return type;
+}
+
+static int *new_int4(int value) {
+	int *res = (int *) pmalloc(sizeof(int));
+
+	*res = value;
+	return res;
+}
+
+static double *new_float8(double value) {
+	double *res = (double *) pmalloc(sizeof(double));
+
+	*res = value;
+	return res;
+}
+
+/* scalar in, scalar out */
+static void init_scalar(plcMsgCallreq *req, bench_options *opts UNUSED) {
+	req->proc.name = "bench_scalar";
+	req->proc.src = "return(a + b)";
+	req->retType = type_float8;
+	req->nargs = 2;
+	req->args = (plcArgument *) pmalloc(sizeof(plcArgument) * 2);
+	set_argument(&req->args[0], "a", &type_int4, new_int4(42));
+	set_argument(&req->args[1], "b", &type_float8, new_float8(0.5));
+}
+
+/* float8[] in, float8[] out */
+static void init_array(plcMsgCallreq *req, bench_options *opts) {
+	plcType *arrtype = new_array_type(&type_float8);
+
+	req->proc.name = "bench_array";
+	req->proc.src = "return(x * 2)";
+	req->retType = *arrtype;
+	req->nargs = 1;
+	req->args = (plcArgument *) pmalloc(sizeof(plcArgument));
+	set_argument(&req->args[0], "x", arrtype, new_bench_array(opts->array_size));
+}
+
+/* composite result built from a one row data.frame */
+static void init_udt(plcMsgCallreq *req, bench_options *opts UNUSED) {
+	plcType *fields = (plcType *) pmalloc(sizeof(plcType) * 3);
+
+	fields[0] = type_int4;
+	fields[1] = type_float8;
+	fields[2] = type_text;
+
+	req->proc.name = "bench_udt";
+	req->proc.src = "return(data.frame(id = id, score = id * 0.5, label = 'row', stringsAsFactors = FALSE))";
+	req->retType.type = PLC_DATA_UDT;
+	req->retType.nSubTypes = 3;
+	req->retType.typeName = "bench_row";
+	req->retType.subTypes = fields;
+	req->nargs = 1;
+	req->args = (plcArgument *) pmalloc(sizeof(plcArgument));
+	set_argument(&req->args[0], "id", &type_int4, new_int4(7));
+}
+
+/* SETOF int4 */
+static void init_setof(plcMsgCallreq *req, bench_options *opts) {
+	req->proc.name = "bench_setof";
+	req->proc.src = "return(seq_len(n))";
+	req->retType = type_int4;
+	req->retset = 1;
+	req->nargs = 1;
+	req->args = (plcArgument *) pmalloc(sizeof(plcArgument));
+	set_argument(&req->args[0], "n", &type_int4, new_int4(opts->setof_rows));
+}
+
+/* q executions of a prepared plan per call, the plan is cached by the client */
+static void init_execp(plcMsgCallreq *req, bench_options *opts) {
+	req->proc.name = "bench_execp";
+	req->proc.src = "plan <- pg.spi.prepare('select id, val from bench where id = $1', 23L)\n"
+	                "n <- 0L\n"
+	                "for (i in seq_len(q)) n <- n + nrow(pg.spi.execp(plan, list(i)))\n"
+	                "return(n)";
+	req->retType = type_int4;
+	req->nargs = 1;
+	req->args = (plcArgument *) pmalloc(sizeof(plcArgument));
+	set_argument(&req->args[0], "q", &type_int4, new_int4(opts->spi_queries));
+}
+
+/* q statements pipelined with pg.spi.submit, then collected */
+static void init_submit(plcMsgCallreq *req, bench_options *opts) {
+	req->proc.name = "bench_submit";
+	req->proc.src = "h <- lapply(seq_len(q), function(i) pg.spi.submit('select id, val from bench'))\n"
+	                "n <- 0L\n"
+	                "for (x in h) n <- n + nrow(pg.spi.collect(x))\n"
+	                "return(n)";
+	req->retType = type_int4;
+	req->nargs = 1;
+	req->args = (plcArgument *) pmalloc(sizeof(plcArgument));
+	set_argument(&req->args[0], "q", &type_int4, new_int4(opts->spi_queries));
+}
+
+/* a plan executed for q rows with pg.spi.execp_bulk */
+static void init_bulk(plcMsgCallreq *req, bench_options *opts) {
+	req->proc.name = "bench_bulk";
+	req->proc.src = "plan <- pg.spi.prepare('insert into bench values ($1, $2)', c(23L, 25L))\n"
+	                "return(pg.spi.execp_bulk(plan, data.frame(id = seq_len(q), val = 'row')))";
+	req->retType = type_float8;
+	req->nargs = 1;
+	req->args = (plcArgument *) pmalloc(sizeof(plcArgument));
+	set_argument(&req->args[0], "q", &type_int4, new_int4(opts->spi_queries));
+}
+
+/*
+ * A bytea argument of b bytes returned as is, it goes through the shared
+ * memory when the client accepted it and the value is large enough
+ */
+static char *new_bytea(int size) {
+	size_t threshold = DEFAULT_SHM_THRESHOLD;
+	char *payload, *res;
+	uint64_t offset = 0, length = (uint64_t) size;
+
+	if (getenv("RCLIENT_SHM_THRESHOLD") != NULL) {
+		threshold = (size_t) atoi(getenv("RCLIENT_SHM_THRESHOLD"));
+	}
+
+	if (shm_base != NULL && (size_t) size >= threshold && (size_t) size <= shm_half) {
+		payload = shm_base;
+		res = (char *) pmalloc(4 + PLC_R_SHM_DESC_SIZE);
+		*((int *) res) = PLC_R_SHM_DESC_SIZE;
+		res[4] = PLC_R_SHM_TAG_REGION;
+		memcpy(res + 5, &offset, sizeof(offset));
+		memcpy(res + 13, &length, sizeof(length));
+	} else if (shm_base != NULL) {
+		res = (char *) pmalloc(5 + size);
+		*((int *) res) = size + 1;
+		res[4] = PLC_R_SHM_TAG_INLINE;
+		payload = res + 5;
+	} else {
+		res = (char *) pmalloc(4 + size);
+		*((int *) res) = size;
+		payload = res + 4;
+	}
+	memset(payload, 0x5a, size);
+
+	return res;
+}
+
+static void init_bytea(plcMsgCallreq *req, bench_options *opts) {
+	req->proc.name = "bench_bytea";
+	req->proc.src = "# plcontainer: rawbytea\n"
+	                "return(x)";
+	req->retType = type_bytea;
+	req->nargs = 1;
+	req->args = (plcArgument *) pmalloc(sizeof(plcArgument));
+	set_argument(&req->args[0], "x", &type_bytea, new_bytea(opts->bytea_size));
+	bytea_copy = (char *) pmalloc(opts->bytea_size);
+}
+
+/* q round trips to the backend per call */
+static void init_spi(plcMsgCallreq *req, bench_options *opts) {
+	req->proc.name = "bench_spi";
+	req->proc.src = "n <- 0L\n"
+	                "for (i in seq_len(q)) n <- n + nrow(pg.spi.exec('select id, val from bench'))\n"
+	                "return(n)";
+	req->retType = type_int4;
+	req->nargs = 1;
+	req->args = (plcArgument *) pmalloc(sizeof(plcArgument));
+	set_argument(&req->args[0], "q", &type_int4, new_int4(opts->spi_queries));
+}
+
+static bench_scenario scenarios[] = {
+	{"scalar", init_scalar},
+	{"array", init_array},
+	{"udt", init_udt},
+	{"setof", init_setof},
+	{"spi", init_spi},
+	{"execp", init_execp},
+	{"submit", init_submit},
+	{"bulk", init_bulk},
+	{"bytea", init_bytea},
+	{NULL, NULL}
+};
+
+static plcMsgResult *new_spi_result(int rows) {
+	plcMsgResult *res = (plcMsgResult *) pmalloc(sizeof(plcMsgResult));
+	int i;
+
+	res->msgtype = MT_RESULT;
+	res->rows = rows;
+	res->cols = 2;
+	res->exception_callback = NULL;
+	res->types = (plcType *) pmalloc(sizeof(plcType) * 2);
+	res->types[0] = type_int4;
+	res->types[1] = type_text;
+	res->names = (char **) pmalloc(sizeof(char *) * 2);
+	res->names[0] = "id";
+	res->names[1] = "val";
+	res->data = (rawdata **) pmalloc(sizeof(rawdata *) * rows);
+	for (i = 0; i < rows; i++) {
+		res->data[i] = (rawdata *) pmalloc(sizeof(rawdata) * 2);
+		res->data[i][0].isnull = 0;
+		res->data[i][0].value = (char *) new_int4(i);
+		res->data[i][1].isnull = 0;
+		res->data[i][1].value = "synthetic value";
+	}
+	return res;
+}
+
+/* the type oids of a prepare arrive as text, anything unknown is sent as text */
+static plcDatatype prepare_arg_type(plcArgument *arg) {
+	switch (arg->data.value != NULL ? atoi(arg->data.value) : 0) {
+		case 16:
+			return PLC_DATA_INT1;
+		case 21:
+			return PLC_DATA_INT2;
+		case 23:
+			return PLC_DATA_INT4;
+		case 20:
+			return PLC_DATA_INT8;
+		case 700:
+			return PLC_DATA_FLOAT4;
+		case 701:
+			return PLC_DATA_FLOAT8;
+		case 17:
+			return PLC_DATA_BYTEA;
+		default:
+			return PLC_DATA_TEXT;
+	}
+}
+
+/*
+ * Answer a prepare like the backend: plan validity, plan pointer, number
+ * of arguments and their types. Executions of any plan get the canned result.
+ */
+static int send_prepared_plan(plcConn *conn, plcMsgSQL *sql) {
+	static long long next_plan = 1;
+	plcMsgRaw reply;
+	plcDatatype type;
+	int32 valid = 1;
+	int32 nargs = sql->nargs;
+	int offset = 0;
+	int i, res;
+
+	reply.msgtype = MT_RAW;
+	reply.size = sizeof(int32) + sizeof(int64) + sizeof(int32) + sizeof(plcDatatype) * nargs;
+	reply.data = (char *) pmalloc(reply.size);
+
+	memcpy(reply.data + offset, &valid, sizeof(int32));
+	offset += sizeof(int32);
+	memcpy(reply.data + offset, &next_plan, sizeof(int64));
+	offset += sizeof(int64);
+	memcpy(reply.data + offset, &nargs, sizeof(int32));
+	offset += sizeof(int32);
+	for (i = 0; i < nargs; i++) {
+		type = prepare_arg_type(&sql->args[i]);
+		memcpy(reply.data + offset, &type, sizeof(plcDatatype));
+		offset += sizeof(plcDatatype);
+	}
+	next_plan += 1;
+
+	res = plcontainer_channel_send(conn, (plcMessage *) &reply);
+	pfree(reply.data);
+	return res;
+}
+
+/* copy the bytea result out of the message or the client's half of the region */
+static int check_bytea_result(plcMsgResult *res) {
+	char *value;
+	uint64_t offset, length;
+
+	if (res->rows != 1 || res->data[0][0].isnull) {
+		fprintf(stderr, "bytea function returned no value\n");
+		return -1;
+	}
+
+	value = res->data[0][0].value;
+	if (shm_base == NULL) {
+		length = (uint64_t) *((int *) value);
+		value += 4;
+	} else if (*((int *) value) >= 1 && value[4] == PLC_R_SHM_TAG_INLINE) {
+		length = (uint64_t) (*((int *) value) - 1);
+		value += 5;
+	} else if (*((int *) value) == PLC_R_SHM_DESC_SIZE && value[4] == PLC_R_SHM_TAG_REGION) {
+		memcpy(&offset, value + 5, sizeof(offset));
+		memcpy(&length, value + 13, sizeof(length));
+		if (offset > shm_half || length > shm_half - offset) {
+			fprintf(stderr, "bytea descriptor is out of the shared memory\n");
+			return -1;
+		}
+		value = shm_base + shm_half + offset;
+	} else {
+		fprintf(stderr, "bytea result has no shared memory tag\n");
+		return -1;
+	}
+
+	if (length != (uint64_t) options.bytea_size) {
+		fprintf(stderr, "bytea function returned %lu bytes instead of %d\n",
+		        (unsigned long) length, options.bytea_size);
+		return -1;
+	}
+	memcpy(bytea_copy, value, length);
+
+	return 0;
+}
+
+static void free_sql(plcMsgSQL *msg) {
+	if (msg->statement != NULL) {
+		pfree(msg->statement);
+	}
+	if (msg->nargs > 0) {
+		free_arguments(msg->args, msg->nargs, false, false);
+	}
+	pfree(msg);
+}
+
+/*
+ * Answer the messages of one call until its result arrives. Returns 0 on
+ * success and -1 if the call failed or the connection was lost.
+ */
+static int run_call(plcConn *conn, plcMsgCallreq *req) {
+	plcMessage *msg;
+	int mask = MT_RESULT_BIT | MT_SQL_BIT | MT_LOG_BIT | MT_EXCEPTION_BIT;
+	int i;
+
+	if (plcontainer_channel_send(conn, (plcMessage *) req) < 0) {
+		fprintf(stderr, "cannot send call request\n");
+		return -1;
+	}
+
+	for (;;) {
+		if (plcontainer_channel_receive(conn, &msg, mask) < 0) {
+			fprintf(stderr, "connection to the client is lost\n");
+			return -1;
+		}
+
+		switch (msg->msgtype) {
+			case MT_SQL: {
+				plcMsgSQL *sql = (plcMsgSQL *) msg;
+				int res = 0;
+
+				switch (sql->sqltype) {
+					case SQL_TYPE_STATEMENT:
+					case SQL_TYPE_PEXECUTE:
+						res = plcontainer_channel_send(conn, (plcMessage *) spi_result);
+						break;
+					case SQL_TYPE_PREPARE:
+						res = send_prepared_plan(conn, sql);
+						break;
+					case SQL_TYPE_UNPREPARE:
+						/* the backend does not answer an unprepare */
+						break;
+					default:
+						fprintf(stderr, "SPI request type %d is not supported by the benchmark\n", sql->sqltype);
+						free_sql(sql);
+						return -1;
+				}
+				free_sql(sql);
+				if (res < 0) {
+					fprintf(stderr, "cannot answer SPI request\n");
+					return -1;
+				}
+				break;
+			}
+			case MT_LOG: {
+				plcMsgLog *log = (plcMsgLog *) msg;
+
+				pfree(log->message);
+				pfree(log);
+				break;
+			}
+			case MT_EXCEPTION: {
+				plcMsgError *err = (plcMsgError *) msg;
+
+				fprintf(stderr, "%s failed: %s\n", req->proc.name, err->message);
+				free_error(err);
+				return -1;
+			}
+			case MT_RESULT: {
+				plcMsgResult *res = (plcMsgResult *) msg;
+				uint32 rows = res->rows;
+
+				if (req->retType.type == PLC_DATA_BYTEA && check_bytea_result(res) != 0) {
+					free_result(res, false);
+					return -1;
+				}
+				free_result(res, false);
+				/* a streamed set ends with an empty result */
+				if (req->retset && options.chunked && rows > 0) {
+					break;
+				}
+				/* keep the array argument ready for the next send */
+				for (i = 0; i < req->nargs; i++) {
+					if (req->args[i].type.type == PLC_DATA_ARRAY) {
+						((plcIterator *) req->args[i].data.value)->cleanup(
+							(plcIterator *) req->args[i].data.value);
+					}
+				}
+				return 0;
+			}
+			default:
+				fprintf(stderr, "unexpected message type %c\n", msg->msgtype);
+				return -1;
+		}
+	}
+}
+
+static int compare_double(const void *a, const void *b) {
+	double x = *(const double *) a;
+	double y = *(const double *) b;
+
+	return (x > y) - (x < y);
+}
+
+static double percentile(double *sorted, int n, double p) {
+	int idx = (int) (p * (n - 1) + 0.5);
+
+	return sorted[idx];
+}
+
+static int run_scenario(plcConn *conn, bench_scenario *scenario, unsigned int objectid) {
+	plcMsgCallreq req;
+	double *latency;
+	double started, total = 0;
+	int i;
+
+	memset(&req, 0, sizeof(req));
+	req.msgtype = MT_CALLREQ;
+	req.objectid = objectid;
+	req.hasChanged = 1;
+	req.logLevel = WARNING;
+	scenario->init(&req, &options);
+
+	for (i = 0; i < options.warmup; i++) {
+		if (run_call(conn, &req) != 0) {
+			return -1;
+		}
+		req.hasChanged = 0;
+	}
+
+	latency = (double *) pmalloc(sizeof(double) * options.calls);
+	for (i = 0; i < options.calls; i++) {
+		started = clock_us();
+		if (run_call(conn, &req) != 0) {
+			pfree(latency);
+			return -1;
+		}
+		req.hasChanged = 0;
+		latency[i] = clock_us() - started;
+		total += latency[i];
+	}
+
+	qsort(latency, options.calls, sizeof(double), compare_double);
+	printf("%-8s %8d %12.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+	       scenario->name, options.calls, options.calls / (total / 1000000.0),
+	       total / options.calls,
+	       percentile(latency, options.calls, 0.50),
+	       percentile(latency, options.calls, 0.90),
+	       percentile(latency, options.calls, 0.99),
+	       latency[options.calls - 1]);
+	fflush(stdout);
+
+	pfree(latency);
+	return 0;
+}
+
+static pid_t start_client(void) {
+	pid_t pid;
+
+	pid = fork();
+	if (pid < 0) {
+		fprintf(stderr, "cannot fork the client: %s\n", strerror(errno));
+		return -1;
+	}
+	if (pid == 0) {
+		/* the client listens on its default port in network mode */
+		if (options.uds_path == NULL) {
+			setenv("USE_CONTAINER_NETWORK", "true", 1);
+		}
+		execl("/bin/sh", "sh", "-c", options.client_cmd, (char *) NULL);
+		fprintf(stderr, "cannot start %s: %s\n", options.client_cmd, strerror(errno));
+		_exit(1);
+	}
+	return pid;
+}
+
+static int connect_once(void) {
+	int sock;
+
+	if (options.uds_path != NULL) {
+		struct sockaddr_un addr;
+
+		sock = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (sock < 0) {
+			return -1;
+		}
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		strncpy(addr.sun_path, options.uds_path, sizeof(addr.sun_path) - 1);
+		if (connect(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+			close(sock);
+			return -1;
+		}
+	} else {
+		struct sockaddr_in addr;
+
+		sock = socket(AF_INET, SOCK_STREAM, 0);
+		if (sock < 0) {
+			return -1;
+		}
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_port = htons(options.port);
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		if (connect(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+			close(sock);
+			return -1;
+		}
+	}
+	return sock;
+}
+
+/* the client listens only after R is initialized, retry until it is up */
+static plcConn *connect_client(void) {
+	double deadline = clock_us() + CONNECT_TIMEOUT_MS * 1000.0;
+	int sock;
+
+	while ((sock = connect_once()) < 0) {
+		if (clock_us() > deadline) {
+			fprintf(stderr, "cannot connect to the client: %s\n", strerror(errno));
+			return NULL;
+		}
+		usleep(10000);
+	}
+	return plcConnInit(sock);
+}
+
+/*
+ * With -m the benchmark offers a region of that many MB before the first
+ * call, as a backend supporting the side channel does. The file is removed
+ * once the client answered, both sides keep their mappings.
+ */
+static int offer_shm(plcConn *conn) {
+	plcMessage *msg;
+	plcMsgRaw offer, *reply;
+	char path[PATH_MAX];
+	char text[PATH_MAX + 64];
+	size_t size = (size_t) options.shm_mb * 1024 * 1024;
+	int fd, accepted;
+
+	if (options.shm_mb <= 0) {
+		return 0;
+	}
+
+	snprintf(path, sizeof(path), "/dev/shm/rbench.%d.shm", (int) getpid());
+	fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd < 0 || ftruncate(fd, (off_t) size) != 0) {
+		fprintf(stderr, "cannot create %s: %s\n", path, strerror(errno));
+		if (fd >= 0) {
+			close(fd);
+			unlink(path);
+		}
+		return -1;
+	}
+	shm_base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (shm_base == MAP_FAILED) {
+		fprintf(stderr, "cannot map %s: %s\n", path, strerror(errno));
+		shm_base = NULL;
+		unlink(path);
+		return -1;
+	}
+	shm_half = size / 2;
+
+	snprintf(text, sizeof(text), "plcshm 1 %s %zu", path, size);
+	offer.msgtype = MT_RAW;
+	offer.data = text;
+	offer.size = strlen(text) + 1;
+	if (plcontainer_channel_send(conn, (plcMessage *) &offer) < 0
+	    || plcontainer_channel_receive(conn, &msg, MT_RAW_BIT) < 0) {
+		fprintf(stderr, "client did not answer the shared memory offer\n");
+		unlink(path);
+		return -1;
+	}
+	unlink(path);
+
+	reply = (plcMsgRaw *) msg;
+	accepted = reply->size == sizeof("plcshm ok") && memcmp(reply->data, "plcshm ok", reply->size) == 0;
+	free_rawmsg(reply);
+	if (!accepted) {
+		fprintf(stderr, "client declined the shared memory, values go inline\n");
+		munmap(shm_base, size);
+		shm_base = NULL;
+		shm_half = 0;
+	}
+	return 0;
+}
+
+static int scenario_selected(const char *name) {
+	const char *p = options.scenarios;
+	size_t len = strlen(name);
+
+	if (p == NULL) {
+		return 1;
+	}
+	while ((p = strstr(p, name)) != NULL) {
+		if ((p == options.scenarios || p[-1] == ',') && (p[len] == '\0' || p[len] == ',')) {
+			return 1;
+		}
+		p += len;
+	}
+	return 0;
+}
+
+static void usage(const char *prog) {
+	fprintf(stderr,
+	        "Usage: %s [options]\n"
+	        "  -c cmd    command starting the client (default %s), empty to\n"
+	        "            connect to a client that is already running\n"
+	        "  -p port   TCP port of the client (default %d)\n"
+	        "  -u path   connect over this unix socket instead of TCP\n"
+	        "  -s list   comma separated scenarios: scalar,array,udt,setof,spi,\n"
+	        "            execp,submit,bulk,bytea\n"
+	        "  -n calls  measured calls per scenario (default 10000)\n"
+	        "  -w calls  warm-up calls per scenario (default 100)\n"
+	        "  -a size   elements of the array argument (default 1000)\n"
+	        "  -r rows   rows returned by the setof function (default 1000)\n"
+	        "  -q count  SPI statements, executions or bulk rows per call (default 10)\n"
+	        "  -R rows   rows of every SPI result (default 100)\n"
+	        "  -b bytes  size of the bytea argument and result (default 1048576)\n"
+	        "  -m MB     offer the client a shared memory region of this size\n",
+	        prog, DEFAULT_CLIENT_CMD, DEFAULT_PORT);
+}
+
+int main(int argc, char **argv) {
+	plcConn *conn;
+	pid_t client = 0;
+	int opt, i, status = 0;
+
+	options.client_cmd = DEFAULT_CLIENT_CMD;
+	options.port = DEFAULT_PORT;
+	options.calls = 10000;
+	options.warmup = 100;
+	options.array_size = 1000;
+	options.setof_rows = 1000;
+	options.spi_queries = 10;
+	options.spi_rows = 100;
+	options.bytea_size = 1024 * 1024;
+
+	while ((opt = getopt(argc, argv, "c:p:u:s:n:w:a:r:q:R:b:m:h")) != -1) {
+		switch (opt) {
+			case 'c': options.client_cmd = optarg; break;
+			case 'p': options.port = atoi(optarg); break;
+			case 'u': options.uds_path = optarg; break;
+			case 's': options.scenarios = optarg; break;
+			case 'n': options.calls = atoi(optarg); break;
+			case 'w': options.warmup = atoi(optarg); break;
+			case 'a': options.array_size = atoi(optarg); break;
+			case 'r': options.setof_rows = atoi(optarg); break;
+			case 'q': options.spi_queries = atoi(optarg); break;
+			case 'R': options.spi_rows = atoi(optarg); break;
+			case 'b': options.bytea_size = atoi(optarg); break;
+			case 'm': options.shm_mb = atoi(optarg); break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+	if (options.calls <= 0 || options.array_size <= 0 || options.spi_rows < 0
+	    || options.bytea_size < 0) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	/* the client inherits the environment, see RCLIENT_RESULT_CHUNK_ROWS */
+	options.chunked = getenv("RCLIENT_RESULT_CHUNK_ROWS") != NULL
+	                  && atoi(getenv("RCLIENT_RESULT_CHUNK_ROWS")) > 0;
+
+	if (options.client_cmd[0] != '\0') {
+		client = start_client();
+		if (client < 0) {
+			return 1;
+		}
+	}
+
+	conn = connect_client();
+	if (conn == NULL || offer_shm(conn) != 0) {
+		if (client > 0) {
+			kill(client, SIGTERM);
+			waitpid(client, NULL, 0);
+		}
+		return 1;
+	}
+
+	spi_result = new_spi_result(options.spi_rows);
+
+	printf("%-8s %8s %12s %10s %10s %10s %10s %10s\n",
+	       "scenario", "calls", "calls/s", "mean us", "p50 us", "p90 us", "p99 us", "max us");
+	for (i = 0; scenarios[i].name != NULL; i++) {
+		if (!scenario_selected(scenarios[i].name)) {
+			continue;
+		}
+		if (run_scenario(conn, &scenarios[i], 100000 + i) != 0) {
+			status = 1;
+			break;
+		}
+	}
+
+	/* the client serves one connection and exits when it is closed */
+	plcDisconnect(conn);
+	if (client > 0) {
+		waitpid(client, NULL, 0);
+	}
+
+	return status;
+}
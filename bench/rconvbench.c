@@ -0,0 +1,482 @@
+/*------------------------------------------------------------------------------
+ *
+ * Copyright (c) 2016-Present Pivotal Software, Inc
+ *
+ *------------------------------------------------------------------------------
+ */
+
+/*
+ * Microbenchmarks of the type converters. Every case runs a converter on a
+ * prepared input inside an arena scope, as handle_call does, and reports the
+ * time and the allocations per element. Allocations are counted by wrapping
+ * plc_r_conv_alloc, plc_r_conv_strdup and pmalloc at link time, see the
+ * rconvbench target in the Makefile.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <R_ext/Parse.h>
+
+#include "rcall.h"
+#include "rarena.h"
+#include "rconversions.h"
+
+/* every case runs at least this long */
+#define MIN_RUN_MS 200.0
+
+#define UDT_INT_FIELDS 12
+#define UDT_FLOAT_FIELDS 10
+#define UDT_TEXT_FIELDS 10
+#define UDT_FIELDS (UDT_INT_FIELDS + UDT_FLOAT_FIELDS + UDT_TEXT_FIELDS)
+
+#define LONG_TEXT_SIZE (1024 * 1024)
+
+/* function source selecting the raw vector converters of bytea */
+#define RAWBYTEA_SRC "# plcontainer: rawbytea\n"
+
+typedef struct conv_case conv_case;
+
+struct conv_case {
+	const char *name;
+	int elements;
+	plcRType *type;
+	char *input;         /* converters from the backend format */
+	SEXP robj;           /* converters from R objects */
+	plcDatatype dtype;   /* get_r_vector */
+	void (*run)(conv_case *c);
+};
+
+/* allocation counters maintained by the link time wrappers */
+static size_t conv_allocs = 0;
+static size_t heap_allocs = 0;
+
+void *__real_pmalloc(size_t size);
+void *__real_plc_r_conv_alloc(size_t size);
+char *__real_plc_r_conv_strdup(const char *str);
+
+void *__wrap_pmalloc(size_t size);
+void *__wrap_plc_r_conv_alloc(size_t size);
+char *__wrap_plc_r_conv_strdup(const char *str);
+
+void *__wrap_pmalloc(size_t size) {
+	heap_allocs++;
+	return __real_pmalloc(size);
+}
+
+void *__wrap_plc_r_conv_alloc(size_t size) {
+	conv_allocs++;
+	return __real_plc_r_conv_alloc(size);
+}
+
+char *__wrap_plc_r_conv_strdup(const char *str) {
+	conv_allocs++;
+	return __real_plc_r_conv_strdup(str);
+}
+
+static double clock_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double) ts.tv_sec * 1000000000.0 + (double) ts.tv_nsec;
+}
+
+static SEXP eval_r(const char *code) {
+	SEXP expr, res = R_NilValue;
+	ParseStatus parse_status;
+	int status, i;
+
+	PROTECT(expr = R_ParseVector(mkString(code), -1, &parse_status, R_NilValue));
+	if (parse_status != PARSE_OK) {
+		fprintf(stderr, "cannot parse %s\n", code);
+		exit(1);
+	}
+	for (i = 0; i < length(expr); i++) {
+		res = R_tryEval(VECTOR_ELT(expr, i), R_GlobalEnv, &status);
+		if (status != 0) {
+			fprintf(stderr, "cannot evaluate %s\n", code);
+			exit(1);
+		}
+	}
+	R_PreserveObject(res);
+	UNPROTECT(1);
+
+	return res;
+}
+
+/*
+ * Resolve the converters of a type the same way a function signature is
+ * resolved, src carries the function options. The function is kept for the
+ * lifetime of the benchmark.
+ */
+static plcRType *resolve_type(plcType *type, int output, char *src) {
+	plcMsgCallreq *call = (plcMsgCallreq *) calloc(1, sizeof(plcMsgCallreq));
+	plcRFunction *func;
+
+	call->msgtype = MT_CALLREQ;
+	call->proc.name = "conv_bench";
+	call->proc.src = src;
+	call->nargs = 1;
+	call->args = (plcArgument *) calloc(1, sizeof(plcArgument));
+	call->args[0].name = "x";
+	call->args[0].type = *type;
+	call->retType = *type;
+
+	func = plc_R_init_function(call);
+	return output ? func->res : &func->args[0];
+}
+
+static plcType *scalar_type(plcDatatype dtype, char *name) {
+	plcType *type = (plcType *) calloc(1, sizeof(plcType));
+
+	type->type = dtype;
+	type->typeName = name;
+	return type;
+}
+
+static plcType *array_type(plcDatatype elmtype) {
+	plcType *type = (plcType *) calloc(1, sizeof(plcType));
+
+	type->type = PLC_DATA_ARRAY;
+	type->typeName = "array";
+	type->nSubTypes = 1;
+	type->subTypes = scalar_type(elmtype, "element");
+	return type;
+}
+
+/* fields are named after their type, from_udt uses the names as columns */
+static plcType *udt_type(void) {
+	plcType *type = (plcType *) calloc(1, sizeof(plcType));
+	char name[16];
+	int i;
+
+	type->type = PLC_DATA_UDT;
+	type->typeName = "wide_row";
+	type->nSubTypes = UDT_FIELDS;
+	type->subTypes = (plcType *) calloc(UDT_FIELDS, sizeof(plcType));
+	for (i = 0; i < UDT_FIELDS; i++) {
+		if (i < UDT_INT_FIELDS) {
+			type->subTypes[i].type = PLC_DATA_INT4;
+			snprintf(name, sizeof(name), "i%d", i + 1);
+		} else if (i < UDT_INT_FIELDS + UDT_FLOAT_FIELDS) {
+			type->subTypes[i].type = PLC_DATA_FLOAT8;
+			snprintf(name, sizeof(name), "f%d", i - UDT_INT_FIELDS + 1);
+		} else {
+			type->subTypes[i].type = PLC_DATA_TEXT;
+			snprintf(name, sizeof(name), "t%d", i - UDT_INT_FIELDS - UDT_FLOAT_FIELDS + 1);
+		}
+		type->subTypes[i].typeName = strdup(name);
+	}
+	return type;
+}
+
+static char *text_value(size_t len) {
+	char *res = (char *) malloc(len + 1);
+
+	memset(res, 'x', len);
+	res[len] = '\0';
+	return res;
+}
+
+/* an array as the channel delivers it, text elements are pointers */
+static char *array_input(plcDatatype elmtype, int size) {
+	plcArray *arr = (plcArray *) malloc(sizeof(plcArray));
+	int i;
+
+	arr->meta = (plcArrayMeta *) malloc(sizeof(plcArrayMeta));
+	arr->meta->type = elmtype;
+	arr->meta->ndims = 1;
+	arr->meta->dims = (int *) malloc(sizeof(int));
+	arr->meta->dims[0] = size;
+	arr->meta->size = size;
+	arr->data = (char *) malloc((size_t) size * plc_get_type_length(elmtype));
+	arr->nulls = (char *) calloc(size, 1);
+
+	for (i = 0; i < size; i++) {
+		switch (elmtype) {
+			case PLC_DATA_INT4:
+				((int32 *) arr->data)[i] = i;
+				break;
+			case PLC_DATA_FLOAT8:
+				((float8 *) arr->data)[i] = i * 0.5;
+				break;
+			default:
+				((char **) arr->data)[i] = text_value(16);
+				break;
+		}
+	}
+	return (char *) arr;
+}
+
+static char *udt_input(void) {
+	plcUDT *udt = (plcUDT *) malloc(sizeof(plcUDT));
+	int i;
+
+	udt->data = (rawdata *) malloc(UDT_FIELDS * sizeof(rawdata));
+	for (i = 0; i < UDT_FIELDS; i++) {
+		udt->data[i].isnull = 0;
+		if (i < UDT_INT_FIELDS) {
+			udt->data[i].value = malloc(sizeof(int32));
+			*((int32 *) udt->data[i].value) = i;
+		} else if (i < UDT_INT_FIELDS + UDT_FLOAT_FIELDS) {
+			udt->data[i].value = malloc(sizeof(float8));
+			*((float8 *) udt->data[i].value) = i * 0.5;
+		} else {
+			udt->data[i].value = text_value(16);
+		}
+	}
+	return (char *) udt;
+}
+
+static char *scalar_input(plcDatatype dtype) {
+	char *res = (char *) malloc(sizeof(float8));
+
+	switch (dtype) {
+		case PLC_DATA_INT1:
+			*((int8 *) res) = 1;
+			break;
+		case PLC_DATA_INT2:
+			*((int16 *) res) = 42;
+			break;
+		case PLC_DATA_INT4:
+			*((int32 *) res) = 42;
+			break;
+		case PLC_DATA_INT8:
+			*((int64 *) res) = 42;
+			break;
+		case PLC_DATA_FLOAT4:
+			*((float4 *) res) = 42.5;
+			break;
+		default:
+			*((float8 *) res) = 42.5;
+			break;
+	}
+	return res;
+}
+
+/* a bytea as the channel delivers it, the bytes of the raw vector code evaluates to */
+static char *bytea_input(const char *code) {
+	SEXP raw = eval_r(code);
+	char *res = (char *) malloc(4 + XLENGTH(raw));
+
+	*((int *) res) = (int) XLENGTH(raw);
+	memcpy(res + 4, (char *) RAW(raw), XLENGTH(raw));
+	R_ReleaseObject(raw);
+	return res;
+}
+
+static void run_input(conv_case *c) {
+	c->type->conv.inputfunc(c->input, c->type);
+	UNPROTECT(1);
+}
+
+/* arrays are drained and freed the way the channel sends them */
+static void run_output(conv_case *c) {
+	char *output = NULL;
+
+	c->type->conv.outputfunc(c->robj, &output, c->type);
+	if (c->type->type == PLC_DATA_ARRAY && output != NULL) {
+		plcIterator *iter = (plcIterator *) output;
+		int i;
+
+		for (i = 0; i < iter->meta->size; i++) {
+			rawdata *raw = iter->next(iter);
+
+			if (raw->value != NULL) {
+				pfree(raw->value);
+			}
+			pfree(raw);
+		}
+		iter->cleanup(iter);
+	}
+}
+
+static void run_vector_element(conv_case *c) {
+	int i;
+
+	for (i = 0; i < c->elements; i++) {
+		plc_r_vector_element_rawdata(c->robj, i, c->type);
+	}
+}
+
+static void run_get_r_vector(conv_case *c) {
+	PROTECT(get_r_vector(c->dtype, c->elements));
+	UNPROTECT(1);
+}
+
+static double run_iterations(conv_case *c, long iterations) {
+	double started = clock_ns();
+	long i;
+
+	for (i = 0; i < iterations; i++) {
+		plcRArenaMark mark = plc_r_arena_begin();
+
+		c->run(c);
+		plc_r_arena_end(mark);
+	}
+	return clock_ns() - started;
+}
+
+static void measure(conv_case *c) {
+	long iterations = 1;
+	double elapsed;
+	double elements;
+
+	/* warm up, then double the iterations until the run is long enough */
+	run_iterations(c, 1);
+	for (;;) {
+		conv_allocs = 0;
+		heap_allocs = 0;
+		elapsed = run_iterations(c, iterations);
+		if (elapsed >= MIN_RUN_MS * 1000000.0) {
+			break;
+		}
+		iterations *= 2;
+	}
+
+	elements = (double) iterations * c->elements;
+	printf("%-32s %10d %10ld %12.2f %12.3f %12.3f\n",
+	       c->name, c->elements, iterations, elapsed / elements,
+	       conv_allocs / elements, heap_allocs / elements);
+	fflush(stdout);
+}
+
+static conv_case input_case(const char *name, plcType *type, char *input, int elements) {
+	conv_case c;
+
+	memset(&c, 0, sizeof(c));
+	c.name = name;
+	c.type = resolve_type(type, 0, "");
+	c.input = input;
+	c.elements = elements;
+	c.run = run_input;
+	return c;
+}
+
+static conv_case output_case(const char *name, plcType *type, const char *code, int elements) {
+	conv_case c;
+
+	memset(&c, 0, sizeof(c));
+	c.name = name;
+	c.type = resolve_type(type, 1, "");
+	c.robj = eval_r(code);
+	c.elements = elements;
+	c.run = run_output;
+	return c;
+}
+
+static conv_case vector_case(const char *name, plcDatatype dtype, int elements) {
+	conv_case c;
+
+	memset(&c, 0, sizeof(c));
+	c.name = name;
+	c.dtype = dtype;
+	c.elements = elements;
+	c.run = run_get_r_vector;
+	return c;
+}
+
+int main(int argc, char **argv) {
+	conv_case cases[48];
+	char *long_text = text_value(LONG_TEXT_SIZE);
+	const char *filter = (argc > 1) ? argv[1] : NULL;
+	int ncases = 0;
+	int i;
+
+	/* the converters are linked in, a dyn.load of librcall.so would load a second copy */
+	if (r_init_linked() != 0) {
+		fprintf(stderr, "cannot initialize R\n");
+		return 1;
+	}
+
+	/* backend format to R */
+	cases[ncases++] = input_case("from_int1", scalar_type(PLC_DATA_INT1, "bool"),
+	                             scalar_input(PLC_DATA_INT1), 1);
+	cases[ncases++] = input_case("from_int2", scalar_type(PLC_DATA_INT2, "int2"),
+	                             scalar_input(PLC_DATA_INT2), 1);
+	cases[ncases++] = input_case("from_int4", scalar_type(PLC_DATA_INT4, "int4"),
+	                             scalar_input(PLC_DATA_INT4), 1);
+	cases[ncases++] = input_case("from_int8", scalar_type(PLC_DATA_INT8, "int8"),
+	                             scalar_input(PLC_DATA_INT8), 1);
+	cases[ncases++] = input_case("from_float4", scalar_type(PLC_DATA_FLOAT4, "float4"),
+	                             scalar_input(PLC_DATA_FLOAT4), 1);
+	cases[ncases++] = input_case("from_float8", scalar_type(PLC_DATA_FLOAT8, "float8"),
+	                             scalar_input(PLC_DATA_FLOAT8), 1);
+	cases[ncases++] = input_case("from_text", scalar_type(PLC_DATA_TEXT, "text"),
+	                             text_value(16), 1);
+	cases[ncases++] = input_case("from_text long", scalar_type(PLC_DATA_TEXT, "text"),
+	                             long_text, 1);
+	cases[ncases++] = input_case("from_array int4 1K", array_type(PLC_DATA_INT4),
+	                             array_input(PLC_DATA_INT4, 1000), 1000);
+	cases[ncases++] = input_case("from_array int4 1M", array_type(PLC_DATA_INT4),
+	                             array_input(PLC_DATA_INT4, 1000000), 1000000);
+	cases[ncases++] = input_case("from_array float8 1K", array_type(PLC_DATA_FLOAT8),
+	                             array_input(PLC_DATA_FLOAT8, 1000), 1000);
+	cases[ncases++] = input_case("from_array float8 1M", array_type(PLC_DATA_FLOAT8),
+	                             array_input(PLC_DATA_FLOAT8, 1000000), 1000000);
+	cases[ncases++] = input_case("from_array text 1K", array_type(PLC_DATA_TEXT),
+	                             array_input(PLC_DATA_TEXT, 1000), 1000);
+	cases[ncases++] = input_case("from_udt 32 fields", udt_type(), udt_input(), UDT_FIELDS);
+	cases[ncases++] = input_case("from_bytea 1M", scalar_type(PLC_DATA_BYTEA, "bytea"),
+	                             bytea_input("serialize(seq_len(131072) * 0.5, NULL)"), 1);
+	cases[ncases] = input_case("from_bytea raw 1M", scalar_type(PLC_DATA_BYTEA, "bytea"),
+	                           bytea_input("as.raw(seq_len(1048576) %% 256L)"), 1);
+	cases[ncases++].type = resolve_type(scalar_type(PLC_DATA_BYTEA, "bytea"), 0, RAWBYTEA_SRC);
+
+	/* R to backend format */
+	cases[ncases++] = output_case("as_int1", scalar_type(PLC_DATA_INT1, "bool"), "TRUE", 1);
+	cases[ncases++] = output_case("as_int2", scalar_type(PLC_DATA_INT2, "int2"), "42L", 1);
+	cases[ncases++] = output_case("as_int4", scalar_type(PLC_DATA_INT4, "int4"), "42L", 1);
+	cases[ncases++] = output_case("as_int8", scalar_type(PLC_DATA_INT8, "int8"), "42", 1);
+	cases[ncases++] = output_case("as_float4", scalar_type(PLC_DATA_FLOAT4, "float4"), "42.5", 1);
+	cases[ncases++] = output_case("as_float8", scalar_type(PLC_DATA_FLOAT8, "float8"), "42.5", 1);
+	cases[ncases++] = output_case("as_text", scalar_type(PLC_DATA_TEXT, "text"),
+	                              "strrep('x', 16)", 1);
+	cases[ncases++] = output_case("as_text long", scalar_type(PLC_DATA_TEXT, "text"),
+	                              "strrep('x', 1048576)", 1);
+	cases[ncases++] = output_case("as_array int4 1K", array_type(PLC_DATA_INT4),
+	                              "seq_len(1000)", 1000);
+	cases[ncases++] = output_case("as_array float8 1K", array_type(PLC_DATA_FLOAT8),
+	                              "seq_len(1000) * 0.5", 1000);
+	cases[ncases++] = output_case("as_array float8 1M", array_type(PLC_DATA_FLOAT8),
+	                              "seq_len(1000000) * 0.5", 1000000);
+	cases[ncases++] = output_case("as_array text 1K", array_type(PLC_DATA_TEXT),
+	                              "as.character(seq_len(1000))", 1000);
+	cases[ncases++] = output_case("as_udt 32 fields", udt_type(),
+	                              "as.data.frame(c(setNames(as.list(1:12), paste0('i', 1:12)),"
+	                              " setNames(as.list(1:10 * 0.5), paste0('f', 1:10)),"
+	                              " setNames(as.list(as.character(1:10)), paste0('t', 1:10))),"
+	                              " stringsAsFactors = FALSE)",
+	                              UDT_FIELDS);
+	cases[ncases++] = output_case("as_bytea 1M", scalar_type(PLC_DATA_BYTEA, "bytea"),
+	                              "seq_len(131072) * 0.5", 1);
+	cases[ncases] = output_case("as_bytea raw 1M", scalar_type(PLC_DATA_BYTEA, "bytea"),
+	                            "as.raw(seq_len(1048576) %% 256L)", 1);
+	cases[ncases++].type = resolve_type(scalar_type(PLC_DATA_BYTEA, "bytea"), 1, RAWBYTEA_SRC);
+
+	/* element access used by the set and array results */
+	cases[ncases] = output_case("vector_element_rawdata int4 1K", scalar_type(PLC_DATA_INT4, "int4"),
+	                            "seq_len(1000)", 1000);
+	cases[ncases++].run = run_vector_element;
+	cases[ncases] = output_case("vector_element_rawdata text 1K", scalar_type(PLC_DATA_TEXT, "text"),
+	                            "as.character(seq_len(1000))", 1000);
+	cases[ncases++].run = run_vector_element;
+
+	/* result vectors of SPI queries */
+	cases[ncases++] = vector_case("get_r_vector float8 1K", PLC_DATA_FLOAT8, 1000);
+	cases[ncases++] = vector_case("get_r_vector float8 1M", PLC_DATA_FLOAT8, 1000000);
+	cases[ncases++] = vector_case("get_r_vector text 1K", PLC_DATA_TEXT, 1000);
+	cases[ncases++] = vector_case("get_r_vector text 1M", PLC_DATA_TEXT, 1000000);
+
+	printf("%-32s %10s %10s %12s %12s %12s\n",
+	       "case", "elements", "iterations", "ns/elem", "conv/elem", "pmalloc/elem");
+	for (i = 0; i < ncases; i++) {
+		if (filter != NULL && strstr(cases[i].name, filter) == NULL) {
+			continue;
+		}
+		measure(&cases[i]);
+	}
+
+	return 0;
+}
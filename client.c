@@ -4,19 +4,163 @@
  *
  *------------------------------------------------------------------------------
  */
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 #include <assert.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
 
 #include "common/comm_channel.h"
 #include "common/comm_utils.h"
 #include "common/comm_connectivity.h"
 #include "common/comm_server.h"
 #include "rcall.h"
+#include "rshm.h"
+#include "rstats.h"
+
+/*
+ * Number of pre-forked workers. Each worker is forked from the initialized
+ * interpreter and serves one connection, the parent forks a replacement
+ * when a worker finishes. Zero serves a single connection in this process.
+ */
+#define PREFORK_WORKERS_ENV "RCLIENT_PREFORK_WORKERS"
+
+/* Bounds of the delay before a failed worker is replaced */
+#define WORKER_BACKOFF_MIN_MS 100
+#define WORKER_BACKOFF_MAX_MS 10000
+
+static void serve_connection(plcConn *conn, int status) {
+	if (status == 0) {
+		if (plc_r_shm_negotiate(conn) == 0) {
+			receive_loop(handle_call, conn);
+		}
+	} else {
+		plc_raise_delayed_error(conn);
+	}
+}
+
+/*
+ * Log how much of the worker memory is still shared copy-on-write with
+ * the parent interpreter and how much became private to the worker
+ */
+static void log_worker_memory(const char *stage) {
+	FILE *f;
+	char line[256];
+	long value, rss = 0, shared = 0, private = 0;
+
+	f = fopen("/proc/self/smaps_rollup", "r");
+	if (f == NULL) {
+		plc_elog(DEBUG1, "Cannot read worker memory usage: %s", strerror(errno));
+		return;
+	}
+
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (sscanf(line, "Rss: %ld kB", &value) == 1) {
+			rss = value;
+		} else if (sscanf(line, "Shared_Clean: %ld kB", &value) == 1
+		           || sscanf(line, "Shared_Dirty: %ld kB", &value) == 1) {
+			shared += value;
+		} else if (sscanf(line, "Private_Clean: %ld kB", &value) == 1
+		           || sscanf(line, "Private_Dirty: %ld kB", &value) == 1) {
+			private += value;
+		}
+	}
+	fclose(f);
+
+	plc_elog(LOG, "R client worker %d %s: rss %ld kB, shared %ld kB, private %ld kB",
+	         (int) getpid(), stage, rss, shared, private);
+}
+
+static pid_t fork_worker(int sock) {
+	double forked = plc_r_clock_ms();
+	pid_t pid;
+
+	pid = fork();
+	if (pid < 0) {
+		plc_elog(WARNING, "Cannot fork R client worker: %s", strerror(errno));
+		return -1;
+	}
+
+	if (pid == 0) {
+		plcConn *conn;
+
+		/*
+		 * Idle workers skip the timeout of connection_wait, the pool keeps
+		 * them until a backend connects and they block in accept instead
+		 */
+		log_worker_memory("ready");
+		plc_elog(LOG, "R client worker %d ready to accept in %.3f ms",
+		         (int) getpid(), plc_r_clock_ms() - forked);
+		conn = connection_init(sock);
+
+		serve_connection(conn, 0);
+
+		log_worker_memory("finished");
+		plc_r_stats_log();
+		exit(0);
+	}
+
+	return pid;
+}
+
+/* Delay before the next fork while workers keep failing, doubled up to the maximum */
+static int next_backoff(int backoff_ms) {
+	if (backoff_ms == 0) {
+		return WORKER_BACKOFF_MIN_MS;
+	}
+	if (backoff_ms * 2 > WORKER_BACKOFF_MAX_MS) {
+		return WORKER_BACKOFF_MAX_MS;
+	}
+	return backoff_ms * 2;
+}
+
+static void run_worker_pool(int sock, int nworkers) {
+	int running = 0;
+	int backoff_ms = 0;
+
+	for (;;) {
+		int wstatus;
+		pid_t pid;
+
+		/* keep the pool warm, every worker that exits is replaced */
+		while (running < nworkers) {
+			if (fork_worker(sock) > 0) {
+				running++;
+			} else {
+				backoff_ms = next_backoff(backoff_ms);
+				usleep(backoff_ms * 1000);
+			}
+		}
+
+		pid = waitpid(-1, &wstatus, 0);
+		if (pid < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			plc_elog(WARNING, "Cannot wait for R client workers: %s", strerror(errno));
+			break;
+		}
+		running--;
+
+		if (WIFEXITED(wstatus) && WEXITSTATUS(wstatus) == 0) {
+			backoff_ms = 0;
+		} else {
+			/* a crashing worker must not turn into a fork loop */
+			backoff_ms = next_backoff(backoff_ms);
+			plc_elog(WARNING, "R client worker %d failed, it is replaced in %d ms",
+			         (int) pid, backoff_ms);
+			usleep(backoff_ms * 1000);
+		}
+	}
+}
 
 int main(int argc UNUSED, char **argv UNUSED) {
 	int sock;
-	plcConn *conn;
 	int status;
+	int nworkers;
 
 	sanity_check_client();
 
@@ -34,17 +178,16 @@ int main(int argc UNUSED, char **argv UNUSED) {
 	plc_elog(LOG, "Client start to listen execution");
 	status = r_init();
 
-	connection_wait(sock);
-	conn = connection_init(sock);
-	if (status == 0) {
-		receive_loop(handle_call, conn);
+	nworkers = plc_r_getenv_int(PREFORK_WORKERS_ENV, 0);
+	if (status == 0 && nworkers > 0) {
+		// Workers share the initialized R heap copy-on-write
+		run_worker_pool(sock, nworkers);
 	} else {
-		plc_raise_delayed_error(conn);
+		connection_wait(sock);
+		serve_connection(connection_init(sock), status);
+		plc_r_stats_log();
 	}
 
 	plc_elog(LOG, "Client has finished execution");
 	return 0;
 }
-
-
-
@@ -0,0 +1,148 @@
+/*------------------------------------------------------------------------------
+ *
+ * Copyright (c) 2016-Present Pivotal Software, Inc
+ *
+ *------------------------------------------------------------------------------
+ */
+#include <R.h>
+#include <Rversion.h>
+#include <Rinternals.h>
+
+#include "common/comm_utils.h"
+#include "rcall.h"
+#include "raltrep.h"
+
+#if (R_VERSION >= R_Version(3, 5, 0))
+#define PLC_R_HAVE_ALTREP
+#include <R_ext/Altrep.h>
+#endif
+
+#ifdef PLC_R_HAVE_ALTREP
+
+/*
+ * Vectors over buffers received from the backend. data1 is an external
+ * pointer owning the buffer, data2 the length. The buffer is private to
+ * the vector, so it is also handed out for writing.
+ */
+static R_altrep_class_t plc_altreal_class;
+static R_altrep_class_t plc_altinteger_class;
+static int altrep_registered = 0;
+
+static void buffer_finalizer(SEXP ptr) {
+	void *data = R_ExternalPtrAddr(ptr);
+
+	if (data != NULL) {
+		pfree(data);
+		R_ClearExternalPtr(ptr);
+	}
+}
+
+static void *buffer_data(SEXP x) {
+	return R_ExternalPtrAddr(R_altrep_data1(x));
+}
+
+static R_xlen_t buffer_length(SEXP x) {
+	return (R_xlen_t) REAL(R_altrep_data2(x))[0];
+}
+
+static Rboolean buffer_inspect(SEXP x, int pre UNUSED, int deep UNUSED, int pvec UNUSED,
+                               void (*inspect_subtree)(SEXP, int, int, int) UNUSED) {
+	Rprintf(" plcontainer message buffer, length %ld\n", (long) buffer_length(x));
+	return TRUE;
+}
+
+static void *buffer_dataptr(SEXP x, Rboolean writeable UNUSED) {
+	return buffer_data(x);
+}
+
+static const void *buffer_dataptr_or_null(SEXP x) {
+	return buffer_data(x);
+}
+
+static double altreal_elt(SEXP x, R_xlen_t i) {
+	return ((double *) buffer_data(x))[i];
+}
+
+static R_xlen_t altreal_get_region(SEXP x, R_xlen_t start, R_xlen_t size, double *buf) {
+	R_xlen_t len = buffer_length(x);
+	R_xlen_t n = (start + size > len) ? len - start : size;
+
+	if (n <= 0) {
+		return 0;
+	}
+	memcpy(buf, (double *) buffer_data(x) + start, n * sizeof(double));
+	return n;
+}
+
+static int altinteger_elt(SEXP x, R_xlen_t i) {
+	return ((int *) buffer_data(x))[i];
+}
+
+static R_xlen_t altinteger_get_region(SEXP x, R_xlen_t start, R_xlen_t size, int *buf) {
+	R_xlen_t len = buffer_length(x);
+	R_xlen_t n = (start + size > len) ? len - start : size;
+
+	if (n <= 0) {
+		return 0;
+	}
+	memcpy(buf, (int *) buffer_data(x) + start, n * sizeof(int));
+	return n;
+}
+
+void plc_r_altrep_init(DllInfo *dll) {
+	plc_altreal_class = R_make_altreal_class("plc_buffer_real", "librcall", dll);
+	R_set_altrep_Length_method(plc_altreal_class, buffer_length);
+	R_set_altrep_Inspect_method(plc_altreal_class, buffer_inspect);
+	R_set_altvec_Dataptr_method(plc_altreal_class, buffer_dataptr);
+	R_set_altvec_Dataptr_or_null_method(plc_altreal_class, buffer_dataptr_or_null);
+	R_set_altreal_Elt_method(plc_altreal_class, altreal_elt);
+	R_set_altreal_Get_region_method(plc_altreal_class, altreal_get_region);
+
+	plc_altinteger_class = R_make_altinteger_class("plc_buffer_integer", "librcall", dll);
+	R_set_altrep_Length_method(plc_altinteger_class, buffer_length);
+	R_set_altrep_Inspect_method(plc_altinteger_class, buffer_inspect);
+	R_set_altvec_Dataptr_method(plc_altinteger_class, buffer_dataptr);
+	R_set_altvec_Dataptr_or_null_method(plc_altinteger_class, buffer_dataptr_or_null);
+	R_set_altinteger_Elt_method(plc_altinteger_class, altinteger_elt);
+	R_set_altinteger_Get_region_method(plc_altinteger_class, altinteger_get_region);
+
+	altrep_registered = 1;
+}
+
+SEXP plc_r_altrep_wrap(plcDatatype type, char *data, R_xlen_t length) {
+	R_altrep_class_t cls;
+	SEXP ptr, len, res;
+
+	if (!altrep_registered) {
+		return R_NilValue;
+	}
+	switch (type) {
+		case PLC_DATA_INT4:
+			cls = plc_altinteger_class;
+			break;
+		case PLC_DATA_FLOAT8:
+			cls = plc_altreal_class;
+			break;
+		default:
+			return R_NilValue;
+	}
+
+	PROTECT(ptr = R_MakeExternalPtr(data, R_NilValue, R_NilValue));
+	R_RegisterCFinalizerEx(ptr, buffer_finalizer, TRUE);
+	PROTECT(len = ScalarReal((double) length));
+	res = R_new_altrep(cls, ptr, len);
+	UNPROTECT(2);
+
+	return res;
+}
+
+#else /* R_VERSION < 3.5.0 */
+
+void plc_r_altrep_init(DllInfo *dll UNUSED) {
+}
+
+SEXP plc_r_altrep_wrap(plcDatatype type UNUSED, char *data UNUSED, R_xlen_t length UNUSED) {
+	return R_NilValue;
+}
+
+#endif /* R_VERSION >= 3.5.0 */
@@ -0,0 +1,29 @@
+/*------------------------------------------------------------------------------
+ *
+ * Copyright (c) 2016-Present Pivotal Software, Inc
+ *
+ *------------------------------------------------------------------------------
+ */
+#ifndef PLC_RALTREP_H
+#define PLC_RALTREP_H
+
+#include <R.h>
+#include <Rinternals.h>
+#include <R_ext/Rdynload.h>
+
+#include "common/messages/messages.h"
+
+/* Smaller arrays are copied, the wrapper would cost more than the copy */
+#define PLC_R_ALTREP_MIN_ELEMENTS 4096
+
+// Register the vector classes, called when librcall is loaded by R
+void plc_r_altrep_init(DllInfo *dll);
+
+/*
+ * Wrap a buffer of int4 or float8 values in an R vector without copying
+ * it. The vector takes ownership of the buffer and frees it with pfree.
+ * Returns R_NilValue if the type is not supported or R has no ALTREP.
+ */
+SEXP plc_r_altrep_wrap(plcDatatype type, char *data, R_xlen_t length);
+
+#endif /* PLC_RALTREP_H */
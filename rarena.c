@@ -0,0 +1,148 @@
+/*------------------------------------------------------------------------------
+ *
+ * Copyright (c) 2016-Present Pivotal Software, Inc
+ *
+ *------------------------------------------------------------------------------
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "common/comm_utils.h"
+#include "rarena.h"
+
+#define ARENA_ALIGN 8
+#define ARENA_ALIGN_UP(x) (((x) + ARENA_ALIGN - 1) & ~((size_t) ARENA_ALIGN - 1))
+
+/*
+ * Bump allocator for the values produced while converting the arguments and
+ * results of a call. Blocks form a stack, releasing to a mark pops the
+ * blocks allocated after it. One regular block is kept for the next call.
+ */
+typedef struct plcRArenaBlock {
+	struct plcRArenaBlock *prev;
+	size_t size;
+	size_t used;
+	char data[];
+} plcRArenaBlock;
+
+static plcRArenaBlock *arena_top = NULL;
+static plcRArenaBlock *arena_spare = NULL;
+
+/* nesting of call scopes, handle_call may be reentered from SPI */
+static int arena_depth = 0;
+static int arena_suspended = 0;
+
+static size_t arena_in_use = 0;
+static size_t arena_call_peak = 0;
+static size_t arena_high_water = 0;
+
+static void arena_free_block(plcRArenaBlock *block) {
+	if (block->size == PLC_R_ARENA_BLOCK_SIZE && arena_spare == NULL) {
+		arena_spare = block;
+	} else {
+		pfree(block);
+	}
+}
+
+static void *arena_alloc(size_t size) {
+	void *ptr;
+
+	size = ARENA_ALIGN_UP(size == 0 ? 1 : size);
+
+	if (arena_top == NULL || arena_top->size - arena_top->used < size) {
+		plcRArenaBlock *block;
+
+		if (size <= PLC_R_ARENA_BLOCK_SIZE && arena_spare != NULL) {
+			block = arena_spare;
+			arena_spare = NULL;
+		} else {
+			size_t block_size = (size > PLC_R_ARENA_BLOCK_SIZE) ? size : PLC_R_ARENA_BLOCK_SIZE;
+
+			block = (plcRArenaBlock *) pmalloc(sizeof(plcRArenaBlock) + block_size);
+			block->size = block_size;
+		}
+		block->used = 0;
+		block->prev = arena_top;
+		arena_top = block;
+	}
+
+	ptr = arena_top->data + arena_top->used;
+	arena_top->used += size;
+
+	arena_in_use += size;
+	if (arena_in_use > arena_call_peak) {
+		arena_call_peak = arena_in_use;
+	}
+	if (arena_in_use > arena_high_water) {
+		arena_high_water = arena_in_use;
+	}
+
+	return ptr;
+}
+
+plcRArenaMark plc_r_arena_begin(void) {
+	plcRArenaMark mark;
+
+	mark.block = arena_top;
+	mark.used = (arena_top == NULL) ? 0 : arena_top->used;
+	mark.depth = arena_depth++;
+
+	return mark;
+}
+
+void plc_r_arena_end(plcRArenaMark mark) {
+	while (arena_top != NULL && arena_top != mark.block) {
+		plcRArenaBlock *block = arena_top;
+
+		arena_top = block->prev;
+		arena_in_use -= block->used;
+		arena_free_block(block);
+	}
+
+	if (arena_top != NULL) {
+		arena_in_use -= arena_top->used - mark.used;
+		arena_top->used = mark.used;
+	}
+
+	/* an R error may have skipped the release of the inner scopes */
+	arena_depth = mark.depth;
+	if (arena_depth == 0) {
+		plc_elog(DEBUG1, "R client arena peak %zu bytes in this call, high-water mark %zu bytes",
+		         arena_call_peak, arena_high_water);
+		arena_call_peak = 0;
+	}
+}
+
+int plc_r_arena_suspend(void) {
+	int state = arena_suspended;
+
+	arena_suspended = 1;
+	return state;
+}
+
+void plc_r_arena_resume(int state) {
+	arena_suspended = state;
+}
+
+int plc_r_arena_active(void) {
+	return arena_depth > 0 && !arena_suspended;
+}
+
+void *plc_r_conv_alloc(size_t size) {
+	if (plc_r_arena_active()) {
+		return arena_alloc(size);
+	}
+	return pmalloc(size);
+}
+
+char *plc_r_conv_strdup(const char *str) {
+	size_t len = strlen(str) + 1;
+	char *res = (char *) plc_r_conv_alloc(len);
+
+	memcpy(res, str, len);
+	return res;
+}
+
+size_t plc_r_arena_high_water(void) {
+	return arena_high_water;
+}
@@ -0,0 +1,44 @@
+/*------------------------------------------------------------------------------
+ *
+ * Copyright (c) 2016-Present Pivotal Software, Inc
+ *
+ *------------------------------------------------------------------------------
+ */
+#ifndef PLC_RARENA_H
+#define PLC_RARENA_H
+
+#include <stddef.h>
+
+/* Size of the regular arena blocks, bigger requests get a block of their own */
+#define PLC_R_ARENA_BLOCK_SIZE (64 * 1024)
+
+/* Position in the arena to release back to */
+typedef struct plcRArenaMark {
+	void *block;
+	size_t used;
+	int depth;
+} plcRArenaMark;
+
+// Start a call scope, allocations made by the conversions go to the arena
+plcRArenaMark plc_r_arena_begin(void);
+
+// Free everything allocated since the matching plc_r_arena_begin
+void plc_r_arena_end(plcRArenaMark mark);
+
+// Route conversion allocations to the heap while the result is handed over
+int plc_r_arena_suspend(void);
+
+void plc_r_arena_resume(int state);
+
+// Allocate memory for conversion output, from the arena inside a call scope
+void *plc_r_conv_alloc(size_t size);
+
+char *plc_r_conv_strdup(const char *str);
+
+// True if the memory of converted values is owned by the arena
+int plc_r_arena_active(void);
+
+// Largest number of bytes the arena held at once
+size_t plc_r_arena_high_water(void);
+
+#endif /* PLC_RARENA_H */
@@ -0,0 +1,171 @@
+/*------------------------------------------------------------------------------
+ *
+ * Copyright (c) 2016-Present Pivotal Software, Inc
+ *
+ *------------------------------------------------------------------------------
+ */
+#include <R.h>
+#include <Rinternals.h>
+
+#include "common/comm_utils.h"
+#include "rcall.h"
+#include "rcache.h"
+
+#define FNV_OFFSET_BASIS 2166136261u
+#define FNV_PRIME        16777619u
+
+/*
+ * Function cache entry. The cache keeps one reference on the function
+ * and the parsed closure is kept alive by R_PreserveObject until the
+ * last reference is dropped.
+ */
+typedef struct plcRCacheEntry {
+	plcRFunction *func;
+	unsigned long lastused;
+} plcRCacheEntry;
+
+static plcRCacheEntry function_cache[PLC_R_FUNCTION_CACHE_SIZE];
+
+/* logical clock used to find the least recently used entry */
+static unsigned long function_cache_clock = 0;
+
+static uint32 hash_bytes(uint32 hash, const void *data, size_t len) {
+	const unsigned char *p = (const unsigned char *) data;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		hash ^= p[i];
+		hash *= FNV_PRIME;
+	}
+	return hash;
+}
+
+static uint32 hash_string(uint32 hash, const char *str) {
+	/* hash the terminating zero too, so that "ab","c" differs from "a","bc" */
+	if (str == NULL) {
+		return hash_bytes(hash, "", 1);
+	}
+	return hash_bytes(hash, str, strlen(str) + 1);
+}
+
+static uint32 hash_type(uint32 hash, plcType *type) {
+	int i;
+	int32 type_id = (int32) type->type;
+	int32 nsubtypes = (int32) type->nSubTypes;
+
+	hash = hash_bytes(hash, &type_id, sizeof(type_id));
+	hash = hash_bytes(hash, &nsubtypes, sizeof(nsubtypes));
+	hash = hash_string(hash, type->typeName);
+	for (i = 0; i < type->nSubTypes; i++) {
+		hash = hash_type(hash, &type->subTypes[i]);
+	}
+	return hash;
+}
+
+uint32 plc_r_signature_hash(plcMsgCallreq *req) {
+	uint32 hash = FNV_OFFSET_BASIS;
+	int i;
+
+	for (i = 0; i < req->nargs; i++) {
+		hash = hash_string(hash, req->args[i].name);
+		hash = hash_type(hash, &req->args[i].type);
+	}
+	hash = hash_type(hash, &req->retType);
+
+	return hash;
+}
+
+uint32 plc_r_function_hash(plcMsgCallreq *req) {
+	uint32 hash = plc_r_signature_hash(req);
+	int32 retset = (int32) req->retset;
+
+	hash = hash_string(hash, req->proc.name);
+	hash = hash_string(hash, req->proc.src);
+	hash = hash_bytes(hash, &retset, sizeof(retset));
+
+	return hash;
+}
+
+static void function_cache_remove(int idx) {
+	plcRFunction *func = function_cache[idx].func;
+
+	function_cache[idx].func = NULL;
+	function_cache[idx].lastused = 0;
+	plc_r_function_release(func);
+}
+
+plcRFunction *plc_r_function_cache_get(plcMsgCallreq *req) {
+	uint32 hash = plc_r_function_hash(req);
+	int i;
+
+	for (i = 0; i < PLC_R_FUNCTION_CACHE_SIZE; i++) {
+		plcRFunction *func = function_cache[i].func;
+
+		if (func == NULL || func->objectid != (unsigned int) req->objectid) {
+			continue;
+		}
+
+		if (func->hash != hash) {
+			/*
+			 * The function was replaced, its source or signature changed. The
+			 * stale entry stays until the new function is put, so that the
+			 * new function can reuse its plan.
+			 */
+			plc_elog(DEBUG1, "R function %s changed, it is parsed again", func->proc.name);
+			return NULL;
+		}
+
+		function_cache[i].lastused = ++function_cache_clock;
+		func->refcount += 1;
+		return func;
+	}
+
+	return NULL;
+}
+
+void plc_r_function_cache_put(plcRFunction *func) {
+	int i;
+	int victim = 0;
+
+	for (i = 0; i < PLC_R_FUNCTION_CACHE_SIZE; i++) {
+		if (function_cache[i].func != NULL && function_cache[i].func->objectid == func->objectid) {
+			/* the stale version of the same function */
+			victim = i;
+			break;
+		}
+		if (function_cache[victim].func == NULL) {
+			continue;
+		}
+		if (function_cache[i].func == NULL
+		    || function_cache[i].lastused < function_cache[victim].lastused) {
+			victim = i;
+		}
+	}
+
+	if (function_cache[victim].func != NULL) {
+		if (function_cache[victim].func->objectid == func->objectid) {
+			plc_elog(DEBUG1, "R function %s replaces its stale version in cache", func->proc.name);
+		} else {
+			plc_elog(DEBUG1, "R function cache is full, evicting %s",
+			         function_cache[victim].func->proc.name);
+		}
+		function_cache_remove(victim);
+	}
+
+	R_PreserveObject(func->RProc);
+	func->refcount += 1;
+	function_cache[victim].func = func;
+	function_cache[victim].lastused = ++function_cache_clock;
+}
+
+void plc_r_function_release(plcRFunction *func) {
+	func->refcount -= 1;
+	if (func->refcount > 0) {
+		return;
+	}
+
+	if (func->RProc != R_NilValue) {
+		R_ReleaseObject(func->RProc);
+	}
+	plc_r_free_function(func);
+}
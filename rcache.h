@@ -0,0 +1,31 @@
+/*------------------------------------------------------------------------------
+ *
+ * Copyright (c) 2016-Present Pivotal Software, Inc
+ *
+ *------------------------------------------------------------------------------
+ */
+#ifndef PLC_RCACHE_H
+#define PLC_RCACHE_H
+
+#include "common/messages/messages.h"
+#include "rconversions.h"
+
+/* Maximum number of parsed functions kept per client */
+#define PLC_R_FUNCTION_CACHE_SIZE 64
+
+// Hash of the argument/return type signature of a function
+uint32 plc_r_signature_hash(plcMsgCallreq *req);
+
+// Hash of the function source and its argument/return type signature
+uint32 plc_r_function_hash(plcMsgCallreq *req);
+
+// Look up a parsed function, returns NULL on miss or if the source changed
+plcRFunction *plc_r_function_cache_get(plcMsgCallreq *req);
+
+// Add a parsed function to the cache, replacing its stale version or evicting the least recently used one
+void plc_r_function_cache_put(plcRFunction *func);
+
+// Drop a reference taken by plc_r_function_cache_get or plc_r_function_cache_put
+void plc_r_function_release(plcRFunction *func);
+
+#endif /* PLC_RCACHE_H */
@@ -13,6 +13,7 @@
 #include <sys/socket.h>
 #include <signal.h>
 #include <limits.h>
+#include <time.h>
 #include <unistd.h>
 
 /* R header files */
@@ -30,8 +31,13 @@
 #include "common/comm_connectivity.h"
 #include "common/comm_server.h"
 #include "rcall.h"
+#include "rcache.h"
+#include "rarena.h"
+#include "raltrep.h"
 #include "rconversions.h"
 #include "rlogging.h"
+#include "rshm.h"
+#include "rstats.h"
 
 #define ERR_MSG_LENGTH 512
 
@@ -47,6 +53,27 @@
 
 #define TYPE_ID_LENGTH 12
 
+/* optimization level passed to compiler::cmpfun, negative disables it */
+#define COMPILE_LEVEL_ENV     "RCLIENT_COMPILE_LEVEL"
+#define DEFAULT_COMPILE_LEVEL 2
+#define MAX_COMPILE_LEVEL     3
+
+/*
+ * Rows per result message for set-returning functions, the set is followed
+ * by an empty result. 0 sends the whole set in one message.
+ */
+#define RESULT_CHUNK_ROWS_ENV "RCLIENT_RESULT_CHUNK_ROWS"
+
+/* statements pg.spi.submit may have in flight before it waits for a result */
+#define SPI_MAX_INFLIGHT_ENV     "RCLIENT_SPI_MAX_INFLIGHT"
+#define DEFAULT_SPI_MAX_INFLIGHT 16
+
+/* threads encoding large vectors of the results, 1 encodes in the calling thread */
+#define ENCODE_THREADS_ENV "RCLIENT_ENCODE_THREADS"
+
+/* R option, "unserialize" decodes bytea columns of SPI results as R objects */
+#define SPI_BYTEA_OPTION "plcontainer.spi.bytea"
+
 #define OPTIONS_NULL_CMD    "options(error = expression(NULL))"
 
 /* install the error handler to call our throw_r_error */
@@ -88,6 +115,31 @@
 		"pg.spi.execp <-function(sql, argvalues = NA) " \
 		"{.Call(\"plr_SPI_execp\", sql, argvalues)}"
 
+#define SPI_EXECP_BULK_CMD \
+		"pg.spi.execp_bulk <-function(sql, argvalues) " \
+		"{.Call(\"plr_SPI_execp_bulk\", sql, argvalues)}"
+
+#define SPI_SUBMIT_CMD \
+		"pg.spi.submit <-function(sql) {.Call(\"plr_SPI_submit\", sql)}"
+
+#define SPI_COLLECT_CMD \
+		"pg.spi.collect <-function(handle) {.Call(\"plr_SPI_collect\", handle)}"
+
+#define SPI_CURSOR_OPEN_CMD \
+		"pg.spi.cursor_open <-function(cursor_name, sql) " \
+		"{.Call(\"plr_SPI_cursor_open\", cursor_name, sql)}"
+
+#define SPI_CURSOR_FETCH_CMD \
+		"pg.spi.cursor_fetch <-function(cursor, forward = TRUE, rows = 1000L) " \
+		"{.Call(\"plr_SPI_cursor_fetch\", cursor, forward, rows)}"
+
+#define SPI_CURSOR_CLOSE_CMD \
+		"pg.spi.cursor_close <-function(cursor) " \
+		"{invisible(.Call(\"plr_SPI_cursor_close\", cursor))}"
+
+#define PG_STATS_CMD \
+		"pg.stats <- function() {.Call(\"plr_stats\")}"
+
 #define PG_LOG_DEBUG_CMD \
 		"plr.debug <- function(msg) {.Call(\"plr_debug\",msg)}"
 #define PG_LOG_LOG_CMD \
@@ -103,6 +155,20 @@
 #define PG_LOG_FATAL_CMD \
 		"plr.fatal <- function(msg) {.Call(\"plr_fatal\",msg)}"
 
+/* byte-compile the functions defined by the bootstrap script at the configured level */
+#define COMPILE_BOOTSTRAP_CMD \
+		"local({" \
+		"  env <- globalenv();" \
+		"  for (f in ls(env)) {" \
+		"    v <- get(f, envir = env);" \
+		"    if (is.function(v)) assign(f, compiler::cmpfun(v, options = list(optimize = %d)), envir = env)" \
+		"  }" \
+		"})"
+
+/* comma separated lists of packages and scripts loaded by r_init */
+#define PRELOAD_PACKAGES_ENV "RCLIENT_PRELOAD_PACKAGES"
+#define PRELOAD_SCRIPTS_ENV  "RCLIENT_PRELOAD_SCRIPTS"
+
 // init variable
 plcConn *plcconn_global;
 
@@ -113,35 +179,73 @@ void throw_pg_notice(const char **msg);
 
 void throw_r_error(const char **msg);
 
+void R_init_librcall(DllInfo *dll);
+
 SEXP plr_SPI_exec(SEXP rsql);
 
 SEXP plr_SPI_prepare(SEXP rsql, SEXP rargtypes);
 
 SEXP plr_SPI_execp(SEXP rsaved_plan, SEXP rargvalues);
 
+SEXP plr_SPI_execp_bulk(SEXP rsaved_plan, SEXP rargcolumns);
+
+SEXP plr_SPI_cursor_open(SEXP rname, SEXP rsql);
+
+SEXP plr_SPI_cursor_fetch(SEXP rname, SEXP rforward, SEXP rrows);
+
+SEXP plr_SPI_cursor_close(SEXP rname);
+
+SEXP plr_SPI_submit(SEXP rsql);
+
+SEXP plr_SPI_collect(SEXP rhandle);
+
 /* Function definitions */
 static char *get_load_self_ref_cmd(void);
 
 static int load_r_cmd(const char *cmd);
 
+static int load_r_step(const char *step, const char *cmd);
+
+static char *join_r_cmds(char **cmds);
+
+static int preload_r_list(const char *env, const char *format);
+
 static void send_error(plcConn *conn, char *msg);
 
 static SEXP parse_r_code(const char *code, plcConn *conn, int *errorOccurred);
 
+static SEXP compile_r_func(plcRFunction *r_func);
+
+static char *check_batch_call(plcRFunction *r_func, int *nrows);
+
 static char *create_r_func(plcMsgCallreq *req);
 
-static int handle_matrix_set(SEXP retval, plcRFunction *r_func, plcMsgResult *res);
+static int handle_matrix_set(SEXP retval, plcRFunction *r_func, plcMsgResult *res, uint32 first, uint32 count);
 
-static int handle_retset(SEXP retval, plcRFunction *r_func, plcMsgResult *res);
+static int handle_retset(SEXP retval, SEXP dfcols, plcRFunction *r_func, plcMsgResult *res, uint32 first, uint32 count);
 
 static int process_call_results(plcConn *conn, SEXP retval, plcRFunction *r_func);
 
 static SEXP arguments_to_r(plcRFunction *r_func);
 
-static void pg_get_one_r(char *value, plcDatatype column_type, SEXP *obj, int elnum);
+static plcMsgResult *receive_SPI_result(void);
+
+static plcMsgResult *wait_SPI_result(void);
 
 static SEXP process_SPI_results();
 
+static SEXP spi_exec_statement(const char *sql);
+
+static void flush_unprepared_plans(void);
+
+static void spi_send_statement(const char *sql);
+
+static void spi_channel_send(plcConn *conn, plcMessage *msg);
+
+static void spi_receive_pending(int id);
+
+static void spi_release_requests(int first_id);
+
 /* Globals */
 
 /* Exposed in R_interface.h */
@@ -151,6 +255,15 @@ int R_SignalHandlers = 1;
 static char *last_R_error_msg,
 	*last_R_notice;
 
+/* byte-compiler optimization level, see COMPILE_LEVEL_ENV */
+static int r_compile_level = DEFAULT_COMPILE_LEVEL;
+
+/* see RESULT_CHUNK_ROWS_ENV */
+static int r_result_chunk_rows = 0;
+
+/* measurements of the call being processed, see rstats.h */
+static plcRCallStats *current_call_stats = NULL;
+
 /* Global PL/Container connection */
 plcConn *plcconn_global;
 plcMsgError *plcLastErrMessage = NULL;
@@ -159,22 +272,74 @@ plcMsgError *plcLastErrMessage = NULL;
 typedef struct r_saved_plan {
 	void *pplan; /* Store the pointer to plan on the QE side. */
 	plcDatatype *argtypes;
+	plcROutputFunc *outfuncs; /* resolved once at prepare time */
 	int nargs;
+	/* cache key, the query text and the type oids it was prepared with */
+	char *query;
+	int *typeoids;
+	/* held by the plan cache and by every R external pointer to the plan */
+	int refcount;
+	unsigned long lastused;
+	struct r_saved_plan *next; /* in the list of plans to unprepare */
 } r_saved_plan;
 
-int r_init(void) {
+/*
+ * Prepared plans are cached by query and argument types, so a prepare in a
+ * loop costs no round trip. The least recently used plan is evicted.
+ */
+#define SPI_PLAN_CACHE_SIZE 32
+
+static r_saved_plan *spi_plan_cache[SPI_PLAN_CACHE_SIZE];
+
+static unsigned long spi_plan_cache_clock = 0;
+
+/*
+ * Plans no longer referenced, their backend plans are freed with
+ * SQL_TYPE_UNPREPARE the next time it is safe to talk to the backend
+ */
+static r_saved_plan *unprepared_plans = NULL;
+
+/*
+ * Statements sent by pg.spi.submit, in the order they were sent. The
+ * backend answers them in that order, results read ahead of their
+ * pg.spi.collect are kept here.
+ */
+typedef struct spi_request {
+	int id;
+	int received;
+	SEXP result; /* preserved once received */
+	struct spi_request *next;
+} spi_request;
+
+static spi_request *spi_requests = NULL;
+
+static int spi_inflight = 0;
+
+static int spi_next_request_id = 1;
+
+/*
+ * First request id of the innermost call. Requests of outer calls are
+ * answered by the backend only after the nested call returns, so a nested
+ * call must never wait for them.
+ */
+static int spi_call_first_request = 1;
+
+/* most statements sent and not answered yet, see SPI_MAX_INFLIGHT_ENV */
+static int r_spi_max_inflight = DEFAULT_SPI_MAX_INFLIGHT;
+
+/*
+ * Start the interpreter. With load_self the .Call entry points come from
+ * librcall.so next to the executable, otherwise they are linked into the
+ * executable itself and only the ALTREP classes are registered with it.
+ */
+static int r_init_interpreter(bool load_self) {
 	char *rargv[] = {"rclient", "--slave", "--silent", "--no-save", "--no-restore"};
 	char *buf;
 	char *r_home;
 	int rargc;
 	int status;
-	int i;
-	char *cmd;
-	char *cmds[] =
+	char *bootstrap[] =
 		{
-			/* first turn off error handling by R */
-			OPTIONS_NULL_CMD,
-
 			/* set up the postgres error handler in R */
 			THROWRERROR_CMD,
 			OPTIONS_THROWRERROR_CMD,
@@ -186,7 +351,13 @@ int r_init(void) {
 			SPI_EXEC_CMD,
 			SPI_PREPARE_CMD,
 			SPI_EXECP_CMD,
+			SPI_EXECP_BULK_CMD,
 			SPI_DBGETQUERY_CMD,
+			SPI_CURSOR_OPEN_CMD,
+			SPI_CURSOR_FETCH_CMD,
+			SPI_CURSOR_CLOSE_CMD,
+			SPI_SUBMIT_CMD,
+			SPI_COLLECT_CMD,
 
 			/* setup debug log to greenplum db */
 			PG_LOG_DEBUG_CMD,
@@ -196,7 +367,9 @@ int r_init(void) {
 			PG_LOG_WARNING_CMD,
 			PG_LOG_ERROR_CMD,
 			PG_LOG_FATAL_CMD,
-			SPI_DBGETQUERY_CMD,
+
+			/* per function call statistics */
+			PG_STATS_CMD,
 
 			/* terminate */
 			NULL
@@ -214,6 +387,23 @@ int r_init(void) {
 		return -1;
 	}
 
+	r_compile_level = plc_r_getenv_int(COMPILE_LEVEL_ENV, DEFAULT_COMPILE_LEVEL);
+	if (r_compile_level > MAX_COMPILE_LEVEL) {
+		r_compile_level = MAX_COMPILE_LEVEL;
+	}
+
+	r_result_chunk_rows = plc_r_getenv_int(RESULT_CHUNK_ROWS_ENV, 0);
+	if (r_result_chunk_rows < 0) {
+		r_result_chunk_rows = 0;
+	}
+
+	r_spi_max_inflight = plc_r_getenv_int(SPI_MAX_INFLIGHT_ENV, DEFAULT_SPI_MAX_INFLIGHT);
+	if (r_spi_max_inflight < 1) {
+		r_spi_max_inflight = 1;
+	}
+
+	plc_r_set_encode_threads(plc_r_getenv_int(ENCODE_THREADS_ENV, 1));
+
 	rargc = sizeof(rargv) / sizeof(rargv[0]);
 
 	if (!Rf_initEmbeddedR(rargc, rargv)) {
@@ -226,27 +416,124 @@ int r_init(void) {
 	 * once the custom R error handler is installed from the plr library
 	 */
 
-	status = load_r_cmd(cmds[0]);
+	status = load_r_step("options", OPTIONS_NULL_CMD);
 
 	if (status < 0) {
 		return -1;
 	}
 
-	status = load_r_cmd(buf = get_load_self_ref_cmd());
+	if (load_self) {
+		status = load_r_step("librcall", buf = get_load_self_ref_cmd());
+		pfree(buf);
+
+		if (status < 0) {
+			return -1;
+		}
+	} else {
+		plc_r_altrep_init(R_getEmbeddingDllInfo());
+	}
+
+	/* the bootstrap commands are parsed and evaluated as a single script */
+	status = load_r_step("bootstrap", buf = join_r_cmds(bootstrap));
 	pfree(buf);
 
 	if (status < 0) {
 		return -1;
 	}
 
-	for (i = 1; (cmd = cmds[i]); i++) {
-		status = load_r_cmd(cmds[i]);
+	if (r_compile_level >= 0) {
+		char compile_cmd[sizeof(COMPILE_BOOTSTRAP_CMD) + 16];
+
+		snprintf(compile_cmd, sizeof(compile_cmd), COMPILE_BOOTSTRAP_CMD, r_compile_level);
+		status = load_r_step("compile", compile_cmd);
 		if (status < 0) {
 			return -1;
 		}
 	}
 
-	return 0;
+	status = preload_r_list(PRELOAD_PACKAGES_ENV, "library(\"%s\")");
+	if (status < 0) {
+		return -1;
+	}
+
+	return preload_r_list(PRELOAD_SCRIPTS_ENV, "source(\"%s\")");
+}
+
+int r_init(void) {
+	return r_init_interpreter(true);
+}
+
+int r_init_linked(void) {
+	return r_init_interpreter(false);
+}
+
+static char *join_r_cmds(char **cmds) {
+	size_t len = 1;
+	char *buf;
+	int i;
+
+	for (i = 0; cmds[i] != NULL; i++) {
+		len += strlen(cmds[i]) + 1;
+	}
+
+	buf = (char *) pmalloc(len);
+	buf[0] = '\0';
+	for (i = 0; cmds[i] != NULL; i++) {
+		strcat(buf, cmds[i]);
+		strcat(buf, "\n");
+	}
+
+	return buf;
+}
+
+static int load_r_step(const char *step, const char *cmd) {
+	double start = plc_r_clock_ms();
+	int status;
+
+	status = load_r_cmd(cmd);
+	plc_elog(LOG, "R client init step %s took %.3f ms", step, plc_r_clock_ms() - start);
+
+	return status;
+}
+
+/*
+ * Evaluate format for every entry of the comma separated list in the
+ * environment variable env, so that packages and models are loaded before
+ * the first call arrives rather than during it
+ */
+static int preload_r_list(const char *env, const char *format) {
+	char *value = getenv(env);
+	char *list,
+		*item,
+		*saveptr;
+	int status = 0;
+
+	if (value == NULL) {
+		return 0;
+	}
+
+	list = strdup(value);
+	for (item = strtok_r(list, ",", &saveptr); item != NULL && status == 0;
+	     item = strtok_r(NULL, ",", &saveptr)) {
+		char cmd[PATH_MAX + 32];
+
+		while (*item == ' ' || *item == '\t') {
+			item++;
+		}
+		if (*item == '\0') {
+			continue;
+		}
+		if (strpbrk(item, "\"\\") != NULL || strlen(item) >= PATH_MAX) {
+			plc_elog(WARNING, "Invalid entry \"%s\" in %s is skipped", item, env);
+			continue;
+		}
+
+		snprintf(cmd, sizeof(cmd), format, item);
+		status = load_r_step(item, cmd);
+	}
+	free(list);
+
+	return status;
 }
 
 static char *get_load_self_ref_cmd() {
@@ -280,6 +567,11 @@ static char *get_load_self_ref_cmd() {
 	return buf;
 }
 
+/* Called by R when the dyn.load above loads the library */
+void R_init_librcall(DllInfo *dll) {
+	plc_r_altrep_init(dll);
+}
+
 static int load_r_cmd(const char *cmd) {
 	SEXP cmdSexp,
 		cmdexpr;
@@ -313,6 +605,15 @@ static int load_r_cmd(const char *cmd) {
 	return -1;
 }
 
+/* Add the call to the statistics of its function, failed calls are counted as errors */
+static void record_call_stats(plcRFunction *r_func, plcRCallStats *stats, bool failed) {
+	stats->failed = failed;
+	if (r_func->stats == NULL) {
+		r_func->stats = plc_r_stats_get(r_func->objectid, r_func->proc.name);
+	}
+	plc_r_stats_record(r_func->stats, stats);
+}
+
 void handle_call(plcMsgCallreq *req, plcConn *conn) {
 	SEXP r,
 		strres,
@@ -324,6 +625,24 @@ void handle_call(plcMsgCallreq *req, plcConn *conn) {
 	char *func,
 		*errmsg;
 
+	int batch_rows = -1;
+
+	plcRFunction *r_func;
+
+	plcRArenaMark mark;
+
+	int first_request;
+
+	int outer_first_request;
+
+	plcRCallStats stats;
+
+	plcRCallStats *outer_stats;
+
+	double start;
+
+	size_t encoded;
+
 	client_log_level = req->logLevel;
 	plc_elog(DEBUG1, "R client receives a call");
 	/*
@@ -331,57 +650,166 @@ void handle_call(plcMsgCallreq *req, plcConn *conn) {
 	*/
 	plcconn_global = conn;
 
-	/* wrap the input in a function and evaluate the result */
-
-	func = create_r_func(req);
+	/* everything converted for this call is released in one go at the end */
+	mark = plc_r_arena_begin();
+	/* a nested call only waits for the statements it submits itself */
+	outer_first_request = spi_call_first_request;
+	first_request = spi_call_first_request = spi_next_request_id;
+
+	/* nested calls from SPI keep their own measurements */
+	memset(&stats, 0, sizeof(stats));
+	outer_stats = current_call_stats;
+	current_call_stats = &stats;
+	start = plc_r_clock_ms();
+
+	r_func = plc_r_function_cache_get(req);
+	if (r_func == NULL) {
+		/* wrap the input in a function and evaluate the result */
+		func = create_r_func(req);
+
+		r_func = plc_R_init_function(req);
+		PROTECT(r = parse_r_code(func, conn, &errorOccurred));
+
+		pfree(func);
+
+		if (errorOccurred) {
+			//TODO send real error message
+			/* run_r_code will send an error back */
+			UNPROTECT(1); //r
+			record_call_stats(r_func, &stats, true);
+			plc_r_function_release(r_func);
+			plc_r_arena_end(mark);
+			current_call_stats = outer_stats;
+			spi_call_first_request = outer_first_request;
+			return;
+		}
 
-	plcRFunction *r_func = plc_R_init_function(req);
-	PROTECT(r = parse_r_code(func, conn, &errorOccurred));
+		/* evaluate the definition once, the resulting closure is what we cache */
+		PROTECT(r_func->RProc = R_tryEval(r, R_GlobalEnv, &errorOccurred));
+		if (errorOccurred) {
+			UNPROTECT(2); //r, RProc
+			if (last_R_error_msg) {
+				errmsg = strdup(last_R_error_msg);
+			} else {
+				errmsg = strdup("Error defining function");
+			}
+			send_error(conn, errmsg);
+			free(errmsg);
+			r_func->RProc = R_NilValue;
+			record_call_stats(r_func, &stats, true);
+			plc_r_function_release(r_func);
+			plc_r_arena_end(mark);
+			current_call_stats = outer_stats;
+			spi_call_first_request = outer_first_request;
+			return;
+		}
 
-	pfree(func);
+		PROTECT(r_func->RProc = compile_r_func(r_func));
+		stats.compile_ms = r_func->compile_ms;
 
-	if (errorOccurred) {
-		//TODO send real error message
-		/* run_r_code will send an error back */
-		UNPROTECT(1); //r
-		return;
+		plc_r_function_cache_put(r_func);
+		UNPROTECT(3); //r, RProc, compiled RProc
+	}
+	/* the cached function outlives the request, point it at the current one */
+	r_func->call = req;
+	stats.phase_ms[PLC_R_PHASE_PARSE] = plc_r_clock_ms() - start;
+
+	if ((r_func->flags & PLC_R_FUNC_BATCH) != 0) {
+		errmsg = check_batch_call(r_func, &batch_rows);
+		if (errmsg != NULL) {
+			send_error(conn, errmsg);
+			free(errmsg);
+			record_call_stats(r_func, &stats, true);
+			plc_r_function_release(r_func);
+			plc_r_arena_end(mark);
+			current_call_stats = outer_stats;
+			spi_call_first_request = outer_first_request;
+			return;
+		}
 	}
 
+	start = plc_r_clock_ms();
+	stats.bytes_in = plc_r_stats_arg_bytes(req);
 	if (req->nargs > 0) {
+		size_t text_bytes = plc_r_text_bytes_converted();
+
 		rargs = arguments_to_r(r_func);
-		PROTECT(call = lcons(r, rargs));
+		PROTECT(call = lcons(r_func->RProc, rargs));
+		stats.bytes_in += plc_r_text_bytes_converted() - text_bytes;
 	} else {
-		PROTECT(call = lcons(r, R_NilValue));
+		PROTECT(call = lcons(r_func->RProc, R_NilValue));
 	}
 
+	stats.phase_ms[PLC_R_PHASE_ARGS] = plc_r_clock_ms() - start;
+
 	/* call the function */
 	plc_is_execution_terminated = 0;
 
+	start = plc_r_clock_ms();
 	PROTECT(strres = R_tryEval(call, R_GlobalEnv, &errorOccurred));
 
+	/* answer the statements the function submitted and did not collect */
+	spi_release_requests(first_request);
+	plr_log_flush();
+	stats.phase_ms[PLC_R_PHASE_EVAL] = plc_r_clock_ms() - start - stats.phase_ms[PLC_R_PHASE_SPI];
+
 	if (errorOccurred) {
-		UNPROTECT(3); //r, strres, call
+		UNPROTECT(2); //strres, call
 		//TODO send real error message
 		if (last_R_error_msg) {
 			errmsg = strdup(last_R_error_msg);
 		} else {
 			errmsg = strdup("Error executing\n");
-			errmsg = realloc(errmsg, strlen(errmsg) + strlen(req->proc.src));
+			errmsg = realloc(errmsg, strlen(errmsg) + strlen(req->proc.src) + 1);
 			errmsg = strcat(errmsg, req->proc.src);
 		}
 		send_error(conn, errmsg);
 		free(errmsg);
-		plc_r_free_function(r_func);
+		record_call_stats(r_func, &stats, true);
+		plc_r_function_release(r_func);
+		plc_r_arena_end(mark);
+		current_call_stats = outer_stats;
+		spi_call_first_request = outer_first_request;
 		return;
 	}
 
+	if (batch_rows >= 0 && plc_is_execution_terminated == 0) {
+		int nrows = isVector(strres) ? Rf_nrows(strres) : length(strres);
+
+		if (nrows != batch_rows) {
+			raise_execution_error("Batch function %s returned %d rows for a batch of %d rows",
+			                      req->proc.name, nrows, batch_rows);
+		}
+	}
+
 	if (plc_is_execution_terminated == 0) {
+		/* the backend reads our messages only until the result arrives */
+		flush_unprepared_plans();
+
+		/*
+		 * The backend has consumed what the previous call left in the shared
+		 * memory. A nested call keeps it, SPI requests of the outer call, e.g.
+		 * queued by pg.spi.execp_bulk, may still point there.
+		 */
+		if (outer_stats == NULL) {
+			plc_r_shm_reset();
+		}
+
+		start = plc_r_clock_ms();
+		encoded = plc_r_bytes_encoded();
 		process_call_results(conn, strres, r_func);
+		stats.bytes_out = plc_r_bytes_encoded() - encoded;
+		stats.phase_ms[PLC_R_PHASE_CONVERT] = plc_r_clock_ms() - start - stats.phase_ms[PLC_R_PHASE_SEND];
 	}
 
-	plc_r_free_function(r_func);
+	record_call_stats(r_func, &stats, plc_is_execution_terminated != 0);
+	current_call_stats = outer_stats;
+	spi_call_first_request = outer_first_request;
 
-	UNPROTECT(3); //r, strres, call
+	plc_r_function_release(r_func);
+	plc_r_arena_end(mark);
+
+	UNPROTECT(2); //strres, call
 	plc_elog(DEBUG1, "R client finished processing this call");
 
 	return;
@@ -453,6 +881,105 @@ static SEXP parse_r_code(const char *code, plcConn *conn, int *errorOccurred) {
 	return NULL;
 }
 
+/*
+ * Byte-compile the function closure. If the compiler fails we keep running
+ * the closure in the AST interpreter. Returns the closure to run, the caller
+ * protects it until the function is cached.
+ */
+static SEXP compile_r_func(plcRFunction *r_func) {
+	SEXP cmpfun,
+		options,
+		call,
+		compiled;
+	int errorOccurred;
+	double start;
+
+	if (r_compile_level < 0 || (r_func->flags & PLC_R_FUNC_NOCOMPILE) != 0) {
+		return r_func->RProc;
+	}
+
+	start = plc_r_clock_ms();
+
+	/* compiler::cmpfun(f, options = list(optimize = level)) */
+	PROTECT(cmpfun = lang3(install("::"), install("compiler"), install("cmpfun")));
+	PROTECT(options = NEW_LIST(1));
+	SET_VECTOR_ELT(options, 0, ScalarInteger(r_compile_level));
+	setAttrib(options, R_NamesSymbol, mkString("optimize"));
+	PROTECT(call = lang3(cmpfun, r_func->RProc, options));
+	SET_TAG(CDDR(call), install("options"));
+
+	PROTECT(compiled = R_tryEval(call, R_GlobalEnv, &errorOccurred));
+	if (errorOccurred) {
+		plc_elog(WARNING, "R function %s cannot be byte-compiled, it will be interpreted: %s",
+		         r_func->proc.name, last_R_error_msg ? last_R_error_msg : "unknown error");
+		UNPROTECT(4);
+		return r_func->RProc;
+	}
+
+	r_func->compile_ms = plc_r_clock_ms() - start;
+	plc_elog(DEBUG1, "R function %s byte-compiled at level %d in %.3f ms",
+	         r_func->proc.name, r_compile_level, r_func->compile_ms);
+
+	UNPROTECT(4);
+	return compiled;
+}
+
+/*
+ * In batch mode each array argument carries one column of a batch of rows.
+ * The function is called once with plain vectors of the batch length, scalar
+ * arguments are shared by all rows, and it must return one value per row.
+ * Returns an error message or NULL if the call is a valid batch.
+ */
+static char *check_batch_call(plcRFunction *r_func, int *nrows) {
+	char errmsg[ERR_MSG_LENGTH];
+	int i;
+
+	*nrows = -1;
+	if (r_func->retset == 0 && r_func->res->type != PLC_DATA_ARRAY) {
+		snprintf(errmsg, sizeof(errmsg), "Batch function %s must return SETOF or an array",
+		         r_func->proc.name);
+		return strdup(errmsg);
+	}
+
+	for (i = 0; i < r_func->nargs; i++) {
+		plcArray *arr;
+		int len;
+
+		if (r_func->args[i].type != PLC_DATA_ARRAY) {
+			continue;
+		}
+
+		if (r_func->call->args[i].data.isnull) {
+			snprintf(errmsg, sizeof(errmsg), "Batch argument %d of %s cannot be NULL",
+			         i + 1, r_func->proc.name);
+			return strdup(errmsg);
+		}
+
+		arr = (plcArray *) r_func->call->args[i].data.value;
+		if (arr->meta->ndims > 1) {
+			snprintf(errmsg, sizeof(errmsg), "Batch argument %d of %s must be a one-dimensional array",
+			         i + 1, r_func->proc.name);
+			return strdup(errmsg);
+		}
+
+		len = (arr->meta->ndims == 0) ? 0 : arr->meta->dims[0];
+		if (*nrows >= 0 && len != *nrows) {
+			snprintf(errmsg, sizeof(errmsg), "Batch argument %d of %s has %d rows, expected %d",
+			         i + 1, r_func->proc.name, len, *nrows);
+			return strdup(errmsg);
+		}
+		*nrows = len;
+	}
+
+	if (*nrows < 0) {
+		snprintf(errmsg, sizeof(errmsg), "Batch function %s needs at least one array argument",
+		         r_func->proc.name);
+		return strdup(errmsg);
+	}
+
+	return NULL;
+}
+
 static char *create_r_func(plcMsgCallreq *req) {
 	int plen;
 	char *mrc;
@@ -501,79 +1028,158 @@ static char *create_r_func(plcMsgCallreq *req) {
 	return mrc;
 }
 
-static int handle_frame(SEXP df, plcRFunction *r_func, plcMsgResult *res) {
+static plcMsgResult *new_call_result(plcRFunction *r_func) {
+	plcMsgResult *res;
+
+	/* allocate a result, it lives in the call arena */
+	res = plc_r_conv_alloc(sizeof(plcMsgResult));
+	res->msgtype = MT_RESULT;
+	res->names = plc_r_conv_alloc(1 * sizeof(char *));
+	res->types = plc_r_conv_alloc(1 * sizeof(plcType));
+	res->exception_callback = NULL;
+	res->rows = 0;
+	res->cols = 1;
+	res->data = NULL;
+
+	plc_r_copy_type(&res->types[0], r_func->res);
+	res->names[0] = plc_r_conv_strdup(r_func->res->argName);
+
+	return res;
+}
+
+static void send_call_result(plcConn *conn, plcMsgResult *res) {
+	double start = plc_r_clock_ms();
+
+	plcontainer_channel_send(conn, (plcMessage *) res);
+	if (current_call_stats != NULL) {
+		current_call_stats->phase_ms[PLC_R_PHASE_SEND] += plc_r_clock_ms() - start;
+	}
+}
+
+/*
+ * Number of rows in the set returned by a function, -1 for a matrix
+ * without dimensions
+ */
+static int retset_rows(SEXP retval) {
+	if (isMatrix(retval) || (IS_CHARACTER(retval) && getAttrib(retval, R_DimSymbol) != R_NilValue)) {
+		SEXP rdims = getAttrib(retval, R_DimSymbol);
+
+		return (rdims == R_NilValue) ? -1 : INTEGER(rdims)[0];
+	} else if (isFrame(retval)) {
+		return (length(retval) > 0) ? length(VECTOR_ELT(retval, 0)) : 0;
+	}
+	return length(retval);
+}
+
+/*
+ * Columns of a data frame ready for conversion, factors are turned into
+ * character vectors once per result instead of once per cell or chunk
+ */
+static SEXP frame_columns(SEXP df) {
+	SEXP dfcols;
+	int col;
+
+	PROTECT(dfcols = allocVector(VECSXP, length(df)));
+	for (col = 0; col < length(df); col++) {
+		SEXP dfcol = VECTOR_ELT(df, col);
+
+		if (isFactor(dfcol)) {
+			SET_VECTOR_ELT(dfcols, col, Rf_asCharacterFactor(dfcol));
+		} else {
+			SET_VECTOR_ELT(dfcols, col, dfcol);
+		}
+	}
+	UNPROTECT(1);
+
+	return dfcols;
+}
+
+/* Columns of a set for handle_retset, R_NilValue unless it is a data frame */
+static SEXP retset_columns(SEXP retval) {
+	if (isFrame(retval) && !isMatrix(retval)) {
+		return frame_columns(retval);
+	}
+	return R_NilValue;
+}
+
+static int handle_frame(SEXP df, SEXP dfcols, plcRFunction *r_func, plcMsgResult *res, uint32 first, uint32 count) {
 	uint32 row, col, cols;
+	rawdata *cells;
 
 	/* a data frame is an array of columns, the length of which is the number of columns */
-	res->cols = 1;
 	cols = length(df);
-	SEXP dfcol = VECTOR_ELT(df, 0);
-	res->rows = length(dfcol);
-	res->data = pmalloc(res->rows * sizeof(rawdata *));
+	if (cols > (uint32) r_func->res->nSubTypes) {
+		raise_execution_error("Data frame has %d columns, the result type has only %d",
+		                      (int) cols, r_func->res->nSubTypes);
+		return -1;
+	}
+	res->rows = count;
 
+	/* cells of all the rows in one block, filled a column at a time */
+	cells = plc_r_conv_alloc(count * cols * sizeof(rawdata));
 
-	plc_r_copy_type(&res->types[0], &r_func->res);
-	res->names[0] = strdup(r_func->res.argName);
+	for (col = 0; col < cols; col++) {
+		SEXP dfcol = VECTOR_ELT(df, col);
+		SEXP values = VECTOR_ELT(dfcols, col);
+		plcRType *coltype = &r_func->res->subTypes[col];
+		bool factor = isFactor(dfcol);
+
+		if (!factor && plc_r_vector_encode_cells(values, first, count, coltype, &cells[col], cols)) {
+			continue;
+		}
 
-	for (row = 0; row < res->rows; row++) {
-		plcUDT *udt;
+		for (row = 0; row < count; row++) {
+			rawdata *cell = &cells[row * cols + col];
 
-		// allocate space for the data
-		res->data[row] = pmalloc(sizeof(rawdata));
+			/* factor codes tell the NA values apart from the "NA" level */
+			if (factor && INTEGER(dfcol)[first + row] == NA_INTEGER) {
+				cell->isnull = TRUE;
+				cell->value = NULL;
+			} else {
+				plc_r_vector_element(values, first + row, coltype, cell);
+			}
+		}
+	}
 
-		// allocate space for the UDT
-		udt = pmalloc(sizeof(plcUDT));
+	res->data = plc_r_conv_alloc(count * sizeof(rawdata *));
 
-		// allocate space for the columns of the UDT
-		udt->data = pmalloc(cols * sizeof(rawdata));
+	if ((r_func->flags & PLC_R_FUNC_COLUMNS) != 0) {
+		SEXP names = getAttrib(df, R_NamesSymbol);
 
+		/* every frame column is a column of the result, rows are not wrapped */
+		res->cols = cols;
+		res->names = plc_r_conv_alloc(cols * sizeof(char *));
+		res->types = plc_r_conv_alloc(cols * sizeof(plcType));
 		for (col = 0; col < cols; col++) {
+			plc_r_copy_type(&res->types[col], &r_func->res->subTypes[col]);
+			res->names[col] = plc_r_conv_strdup((names == R_NilValue) ? ""
+			                                    : CHAR(STRING_ELT(names, col)));
+		}
+		for (row = 0; row < count; row++) {
+			res->data[row] = &cells[row * cols];
+		}
+	} else {
+		plcUDT *udts = plc_r_conv_alloc(count * sizeof(plcUDT));
+		rawdata *rows = plc_r_conv_alloc(count * sizeof(rawdata));
 
-			PROTECT(dfcol = VECTOR_ELT(df, col));
-			/*
-			* R stores characters in factors for efficiency...
-			*/
-			if (isFactor(dfcol)) {
-				/*
-				 * a factor is a special type of integer
-				 * but must check for NA value first
-				 */
-				if (INTEGER(dfcol)[row] != NA_INTEGER) {
-					SEXP c;
-					PROTECT(c = Rf_asCharacterFactor(dfcol));
-
-					rawdata *datum = plc_r_vector_element_rawdata(c, row, &r_func->res.subTypes[col]);
-					udt->data[col].isnull = datum->isnull;
-					udt->data[col].value = datum->value;
-
-					UNPROTECT(1);
-					free(datum);
-				} else {
-					udt->data[col].isnull = TRUE;
-					udt->data[col].value = NULL;
-				}
-			} else {
-				rawdata *datum = plc_r_vector_element_rawdata(dfcol, row, &r_func->res.subTypes[col]);
-				udt->data[col].isnull = datum->isnull;
-				udt->data[col].value = datum->value;
-				free(datum);
-			}
-			UNPROTECT(1);
+		res->cols = 1;
+		for (row = 0; row < count; row++) {
+			udts[row].data = &cells[row * cols];
+			rows[row].isnull = FALSE;
+			rows[row].value = (char *) &udts[row];
+			res->data[row] = &rows[row];
 		}
-		res->data[row]->value = (char *) udt;
-		res->data[row]->isnull = FALSE;
 	}
 	return 0;
 }
 
-static int handle_matrix_set(SEXP retval, plcRFunction *r_func, plcMsgResult *res) {
+static int handle_matrix_set(SEXP retval, plcRFunction *r_func, plcMsgResult *res, uint32 first, uint32 count) {
 	int cols, start = 0;
 	uint32 i;
 	SEXP rdims;
 	PROTECT(rdims = getAttrib(retval, R_DimSymbol));
-	// get the number of rows
+	// get the number of columns
 	if (rdims != R_NilValue) {
-		res->rows = INTEGER(rdims)[0];
 		cols = INTEGER(rdims)[1];
 	} else {
 		UNPROTECT(1);
@@ -582,21 +1188,19 @@ static int handle_matrix_set(SEXP retval, plcRFunction *r_func, plcMsgResult *re
 	UNPROTECT(1);
 
 	// this is a matrix of vectors but we only handle one column in set of right now
+	res->rows = count;
 	res->cols = 1;
-	res->data = malloc(res->rows * sizeof(rawdata *));
+	res->data = plc_r_conv_alloc(res->rows * sizeof(rawdata *));
 
 	for (i = 0; i < res->rows; i++) {
-		res->data[i] = malloc(cols * sizeof(rawdata));
+		res->data[i] = plc_r_conv_alloc(cols * sizeof(rawdata));
 	}
-	plc_r_copy_type(&res->types[0], &r_func->res);
-	res->names[0] = strdup(r_func->res.argName);
 
-	start = 0;
+	start = first * cols;
 
 	for (i = 0; i < res->rows; i++) {
 		res->data[i][0].isnull = 0;
-		if (plc_r_matrix_as_setof(retval, start, cols, &res->data[i][0].value, &r_func->res) != 0) {
-			free_result(res, true);
+		if (plc_r_matrix_as_setof(retval, start, cols, &res->data[i][0].value, r_func->res) != 0) {
 			return -1;
 		}
 		start = start + cols;
@@ -604,7 +1208,11 @@ static int handle_matrix_set(SEXP retval, plcRFunction *r_func, plcMsgResult *re
 	return 0;
 }
 
-static int handle_retset(SEXP retval, plcRFunction *r_func, plcMsgResult *res) {
+/*
+ * Convert rows first .. first + count - 1 of the set returned by the function,
+ * dfcols are its columns from retset_columns
+ */
+static int handle_retset(SEXP retval, SEXP dfcols, plcRFunction *r_func, plcMsgResult *res, uint32 first, uint32 count) {
 	uint32 i = 0;
 	rawdata *raw;
 
@@ -615,31 +1223,38 @@ static int handle_retset(SEXP retval, plcRFunction *r_func, plcMsgResult *res) {
 	 *  having a dimension should guarantee that it is an array of text
 	 */
 	if (isMatrix(retval) || (IS_CHARACTER(retval) && getAttrib(retval, R_DimSymbol) != R_NilValue)) {
-		handle_matrix_set(retval, r_func, res);
+		return handle_matrix_set(retval, r_func, res, first, count);
 	} else if (isFrame(retval)) {
-		handle_frame(retval, r_func, res);
+		return handle_frame(retval, dfcols, r_func, res, first, count);
 	} else {
-		res->rows = length(retval);
+		rawdata *cells;
+
+		res->rows = count;
 		res->cols = 1;
-		res->data = malloc(res->rows * sizeof(rawdata *));
+		res->data = plc_r_conv_alloc(res->rows * sizeof(rawdata *));
+
+		if (r_func->res->conv.outputfunc == NULL) {
+			raise_execution_error("Type %d is not yet supported by R container",
+			                      (int) res->types[0].type);
+			return -1;
+		}
+
+		/* numeric and character vectors are encoded in one pass */
+		cells = plc_r_conv_alloc(count * sizeof(rawdata));
+		if (plc_r_vector_encode_cells(retval, first, count, r_func->res, cells, 1)) {
+			for (i = 0; i < res->rows; i++) {
+				res->data[i] = &cells[i];
+			}
+			return 0;
+		}
 
 		for (i = 0; i < res->rows; i++) {
 			res->data[i] = NULL;
 		}
-		plc_r_copy_type(&res->types[0], &r_func->res);
-		res->names[0] = strdup(r_func->res.argName);
 
 		for (i = 0; i < res->rows; i++) {
-
-			if (r_func->res.conv.outputfunc == NULL) {
-				raise_execution_error("Type %d is not yet supported by R container",
-				                      (int) res->types[0].type);
-				free_result(res, true);
-				return -1;
-			}
-			raw = plc_r_vector_element_rawdata(retval, i, &r_func->res);
+			raw = plc_r_vector_element_rawdata(retval, first + i, r_func->res);
 			if (raw == NULL) {
-				free_result(res, true);
 				return -1;
 			} else {
 				res->data[i] = raw;
@@ -650,23 +1265,72 @@ static int handle_retset(SEXP retval, plcRFunction *r_func, plcMsgResult *res) {
 	return 0;
 }
 
+/*
+ * Send a set in chunks of r_result_chunk_rows rows, each chunk is released
+ * once it is on the wire. An empty result marks the end of the set.
+ */
+static int stream_retset(plcConn *conn, SEXP retval, plcRFunction *r_func) {
+	plcMsgResult *res;
+	plcRArenaMark mark;
+	SEXP dfcols;
+	int rows, first;
+
+	rows = retset_rows(retval);
+	if (rows < 0) {
+		return -1;
+	}
+
+	PROTECT(dfcols = retset_columns(retval));
+	for (first = 0; first < rows; first += r_result_chunk_rows) {
+		int count = rows - first;
+
+		if (count > r_result_chunk_rows) {
+			count = r_result_chunk_rows;
+		}
+
+		mark = plc_r_arena_begin();
+		res = new_call_result(r_func);
+		if (handle_retset(retval, dfcols, r_func, res, first, count) != 0) {
+			plc_r_arena_end(mark);
+			UNPROTECT(1);
+			return -1;
+		}
+		send_call_result(conn, res);
+		plc_r_arena_end(mark);
+	}
+	UNPROTECT(1);
+
+	mark = plc_r_arena_begin();
+	res = new_call_result(r_func);
+	send_call_result(conn, res);
+	plc_r_arena_end(mark);
+
+	return 0;
+}
+
 static int process_call_results(plcConn *conn, SEXP retval, plcRFunction *r_func) {
 	plcMsgResult *res;
 	uint32 i = 0;
 	int ret = 0;
+	int rows;
 
+	if (r_func->retset != 0 && r_result_chunk_rows > 0) {
+		return stream_retset(conn, retval, r_func);
+	}
 
-	/* allocate a result */
-	res = malloc(sizeof(plcMsgResult));
-	res->msgtype = MT_RESULT;
-	res->names = malloc(1 * sizeof(char *));
-	res->types = malloc(1 * sizeof(plcType));
-	res->exception_callback = NULL;
-
+	res = new_call_result(r_func);
 
 	if (r_func->retset != 0) {
-		if (handle_retset(retval, r_func, res) != 0) {
-			free_result(res, true);
+		SEXP dfcols;
+
+		rows = retset_rows(retval);
+		if (rows < 0) {
+			return -1;
+		}
+		PROTECT(dfcols = retset_columns(retval));
+		ret = handle_retset(retval, dfcols, r_func, res, 0, rows);
+		UNPROTECT(1);
+		if (ret != 0) {
 			return -1;
 		}
 	} else {
@@ -674,12 +1338,10 @@ static int process_call_results(plcConn *conn, SEXP retval, plcRFunction *r_func
 		res->rows = 1;
 		res->cols = 1;
 
-		res->data = malloc(res->rows * sizeof(rawdata *));
+		res->data = plc_r_conv_alloc(res->rows * sizeof(rawdata *));
 		for (i = 0; i < res->rows; i++) {
-			res->data[i] = malloc(res->cols * sizeof(rawdata));
+			res->data[i] = plc_r_conv_alloc(res->cols * sizeof(rawdata));
 		}
-		plc_r_copy_type(&res->types[0], &r_func->res);
-		res->names[0] = strdup(r_func->res.argName);
 
 		if (retval == R_NilValue) {
 			res->data[0][0].isnull = 1;
@@ -689,51 +1351,46 @@ static int process_call_results(plcConn *conn, SEXP retval, plcRFunction *r_func
 			for (i = 0; i < res->rows; i++) {
 
 				res->data[i][0].isnull = 0;
-				if (r_func->res.conv.outputfunc == NULL) {
+				if (r_func->res->conv.outputfunc == NULL) {
 					raise_execution_error("Type %d is not yet supported by R container",
 					                      (int) res->types[0].type);
-					free_result(res, true);
 					return -1;
 				}
 
-				ret = r_func->res.conv.outputfunc(retval, &res->data[i][0].value, &r_func->res);
+				ret = r_func->res->conv.outputfunc(retval, &res->data[i][0].value, r_func->res);
 
 				if (ret != 0) {
 					raise_execution_error("Exception raised converting function output to function output type %d",
 					                      (int) res->types[0].type);
-					free_result(res, true);
 					return -1;
 				}
 			}
 		}
 	}
 	/* send the result back */
-	plcontainer_channel_send(conn, (plcMessage *) res);
-
-	free_result(res, true);
+	send_call_result(conn, res);
 
 	return 0;
 }
 
 static SEXP arguments_to_r(plcRFunction *r_func) {
 	SEXP r_args, r_curarg, allargs, element;
-	int i, notnull = 0;
-
-	/* number of arguments that have names and should make it to the input tuple */
-	for (i = 0; i < r_func->nargs; i++) {
-		if (r_func->call->args[i].name != NULL) {
-			notnull += 1;
-		}
-	}
+	int i;
 
-	/* create the argument list plus 1 for the unnamed args list */
-	PROTECT(r_args = r_curarg = allocList(notnull + 1));
+	/*
+	 * create the argument list plus 1 for the unnamed args list,
+	 * only arguments that have names make it to the input tuple
+	 */
+	PROTECT(r_args = r_curarg = allocList(r_func->plan->nnamed + 1));
 	PROTECT(allargs = allocList(r_func->nargs));
 
 	/* all argument vector is the 1st argument */
 	SETCAR(r_curarg, allargs);
 	r_curarg = CDR(r_curarg);
 
+	/* the request is freed after the call, large arrays can keep its buffers */
+	plc_r_set_adopt_arrays(true);
+
 	for (i = 0; i < r_func->nargs; i++) {
 
 		if (r_func->call->args[i].data.isnull) {
@@ -744,6 +1401,7 @@ static SEXP arguments_to_r(plcRFunction *r_func) {
 				raise_execution_error("Parameter '%s' type %d is not supported",
 				                      r_func->args[i].argName,
 				                      r_func->args[i].type);
+				plc_r_set_adopt_arrays(false);
 				UNPROTECT(2);
 				return NULL;
 			}
@@ -757,11 +1415,17 @@ static SEXP arguments_to_r(plcRFunction *r_func) {
 			                      r_func->args[i].argName);
 
 			/* we've made it to the i'th argument */
+			plc_r_set_adopt_arrays(false);
 			UNPROTECT(2 + i - 1);
 			return NULL;
 		}
 
-		if (r_func->call->args[i].name != NULL) {
+		if ((r_func->flags & PLC_R_FUNC_BATCH) != 0 && r_func->args[i].type == PLC_DATA_ARRAY) {
+			/* batch columns are passed as plain vectors */
+			setAttrib(element, R_DimSymbol, R_NilValue);
+		}
+
+		if (r_func->args[i].argName != NULL) {
 			SETCAR(r_curarg, element);
 			r_curarg = CDR(r_curarg);
 		}
@@ -770,91 +1434,188 @@ static SEXP arguments_to_r(plcRFunction *r_func) {
 		SETCAR(allargs, element);
 		allargs = CDR(allargs);
 	}
+	plc_r_set_adopt_arrays(false);
+
 	/* the input function above returns args protected */
 	UNPROTECT(r_func->nargs + 2);
 	return r_args;
 }
 
 /*
- * given a single non-array pg value, convert to its R value representation
+ * Column fillers of SPI results, one is picked per column so that the type
+ * is not switched on for every cell. Null cells become NA.
  */
-static void pg_get_one_r(char *value, plcDatatype column_type, SEXP *obj, int elnum) {
+typedef void (*spi_column_filler)(plcMsgResult *result, uint32 col, SEXP vec);
 
-	int bsize;
-	switch (column_type) {
+static void spi_fill_int1(plcMsgResult *result, uint32 col, SEXP vec) {
+	int *dst = LOGICAL_DATA(vec);
+	uint32 i;
+
+	for (i = 0; i < result->rows; i++) {
+		rawdata *cell = &result->data[i][col];
+
+		dst[i] = cell->isnull ? NA_LOGICAL : *((int8 *) cell->value);
+	}
+}
+
+/* 2 and 4 byte integer pgsql datatype => use R INTEGER */
+static void spi_fill_int2(plcMsgResult *result, uint32 col, SEXP vec) {
+	int *dst = INTEGER_DATA(vec);
+	uint32 i;
+
+	for (i = 0; i < result->rows; i++) {
+		rawdata *cell = &result->data[i][col];
 
-		/* 2 and 4 byte integer pgsql datatype => use R INTEGER */
+		dst[i] = cell->isnull ? NA_INTEGER : *((int16 *) cell->value);
+	}
+}
+
+static void spi_fill_int4(plcMsgResult *result, uint32 col, SEXP vec) {
+	int *dst = INTEGER_DATA(vec);
+	uint32 i;
+
+	for (i = 0; i < result->rows; i++) {
+		rawdata *cell = &result->data[i][col];
+
+		dst[i] = cell->isnull ? NA_INTEGER : *((int32 *) cell->value);
+	}
+}
+
+/*
+ * Other numeric types => use R REAL
+ * Note pgsql int8 is mapped to R REAL
+ * because R INTEGER is only 4 byte
+ */
+static void spi_fill_int8(plcMsgResult *result, uint32 col, SEXP vec) {
+	double *dst = NUMERIC_DATA(vec);
+	uint32 i;
+
+	for (i = 0; i < result->rows; i++) {
+		rawdata *cell = &result->data[i][col];
+
+		dst[i] = cell->isnull ? NA_REAL : (int64) (*((float8 *) cell->value));
+	}
+}
+
+static void spi_fill_float4(plcMsgResult *result, uint32 col, SEXP vec) {
+	double *dst = NUMERIC_DATA(vec);
+	uint32 i;
+
+	for (i = 0; i < result->rows; i++) {
+		rawdata *cell = &result->data[i][col];
+
+		dst[i] = cell->isnull ? NA_REAL : *((float4 *) cell->value);
+	}
+}
+
+static void spi_fill_float8(plcMsgResult *result, uint32 col, SEXP vec) {
+	double *dst = NUMERIC_DATA(vec);
+	uint32 i;
+
+	for (i = 0; i < result->rows; i++) {
+		rawdata *cell = &result->data[i][col];
+
+		dst[i] = cell->isnull ? NA_REAL : *((float8 *) cell->value);
+	}
+}
+
+static bool spi_bytea_unserialize(void) {
+	SEXP opt = GetOption1(install(SPI_BYTEA_OPTION));
+
+	return isString(opt) && LENGTH(opt) > 0
+	       && strcmp(CHAR(STRING_ELT(opt, 0)), "unserialize") == 0;
+}
+
+/*
+ * bytea values are length-prefixed, each becomes a raw vector of the list
+ * column, or the R object it holds in unserialize mode. NULL stays NULL.
+ */
+static void spi_fill_bytea(plcMsgResult *result, uint32 col, SEXP vec) {
+	bool unserialize = spi_bytea_unserialize();
+	uint32 i;
+
+	for (i = 0; i < result->rows; i++) {
+		char *value = result->data[i][col].value;
+
+		if (result->data[i][col].isnull || value == NULL) {
+			SET_VECTOR_ELT(vec, i, R_NilValue);
+		} else {
+			SET_VECTOR_ELT(vec, i, plc_r_bytea_to_r(value, unserialize));
+			UNPROTECT(1);
+		}
+	}
+}
+
+/* Everything else is defaulted to string */
+static void spi_fill_text(plcMsgResult *result, uint32 col, SEXP vec) {
+	uint32 i;
+
+	for (i = 0; i < result->rows; i++) {
+		char *value = result->data[i][col].value;
+
+		if (result->data[i][col].isnull || value == NULL) {
+			SET_STRING_ELT(vec, i, NA_STRING);
+		} else {
+			SET_STRING_ELT(vec, i, COPY_TO_USER_STRING(value));
+		}
+	}
+}
+
+static void spi_fill_unhandled(plcMsgResult *result, uint32 col, SEXP vec UNUSED) {
+	raise_execution_error("unhandled type %s [%d]",
+	                      plc_get_type_name(result->types[col].type), result->types[col].type);
+}
+
+static spi_column_filler get_spi_column_filler(plcDatatype column_type) {
+	switch (column_type) {
+		case PLC_DATA_INT1:
+			return spi_fill_int1;
 		case PLC_DATA_INT2:
-			INTEGER_DATA(*obj)[elnum] = *((int16 *) value);
-			break;
+			return spi_fill_int2;
 		case PLC_DATA_INT4:
-			INTEGER_DATA(*obj)[elnum] = *((int32 *) value);
-			break;
-
-			/*
-			 * Other numeric types => use R REAL
-			 * Note pgsql int8 is mapped to R REAL
-			 * because R INTEGER is only 4 byte
-			 */
+			return spi_fill_int4;
 		case PLC_DATA_INT8:
-			NUMERIC_DATA(*obj)[elnum] = (int64) (*((float8 *) value));
-			break;
+			return spi_fill_int8;
 		case PLC_DATA_FLOAT4:
-			NUMERIC_DATA(*obj)[elnum] = *((float4 *) value);
-			break;
+			return spi_fill_float4;
 		case PLC_DATA_FLOAT8:
-			NUMERIC_DATA(*obj)[elnum] = *((float8 *) value);
-			break;
-
-		case PLC_DATA_INT1:
-			LOGICAL_DATA(*obj)[elnum] = *((int8 *) value);
-			break;
-
+			return spi_fill_float8;
 		case PLC_DATA_UDT:
 		case PLC_DATA_INVALID:
 		case PLC_DATA_ARRAY:
-			raise_execution_error("unhandled type %s [%d]",
-			                      plc_get_type_name(column_type), column_type);
-			break;
-
+			return spi_fill_unhandled;
 		case PLC_DATA_BYTEA:
-			/*
-			 * for bytea type, we first get its size then do copy
-			 * based on upstream, we trade it as TEXT, so '\0' is
-			 * not accepted in bytea type
-			 */
-			if (value[0] != '\0') {
-				bsize = *((int *) value);
-				SET_STRING_ELT(*obj, elnum, mkCharLen(value + 4, bsize));
-				break;
-			}
-			// fallthrough
+			return spi_fill_bytea;
 		case PLC_DATA_TEXT:
 		default:
-			/* Everything else is defaulted to string */
-			if (value) {
-				SET_STRING_ELT(*obj, elnum, COPY_TO_USER_STRING(value));
-			} else {
-				SET_STRING_ELT(*obj, elnum, NA_STRING);
-			}
+			return spi_fill_text;
+	}
+}
+
+/* Add the time since start to the SPI phase of the current call */
+static void record_spi_wait(double start) {
+	if (current_call_stats != NULL) {
+		current_call_stats->phase_ms[PLC_R_PHASE_SPI] += plc_r_clock_ms() - start;
 	}
 }
 
 /*
- * common function for SPI exec and SPI execp to extract returned results
+ * Wait for the reply to an SPI request, serving the calls and pings the
+ * backend sends meanwhile. Returns NULL if no result arrived.
  */
-static SEXP process_SPI_results() {
+static plcMsgResult *receive_SPI_result(void) {
+	double start = plc_r_clock_ms();
 	plcMsgResult *result;
-	plcMessage *resp;
-	SEXP r_result = NULL,
-		names,
-		row_names,
-		fldvec;
 
-	uint32 i, j;
-	int res = 0;
+	result = wait_SPI_result();
+	record_spi_wait(start);
 
-	char buf[256];
+	return result;
+}
+
+static plcMsgResult *wait_SPI_result(void) {
+	plcMessage *resp;
+	int res = 0;
 
 receive:
 	res = plcontainer_channel_receive(plcconn_global, &resp, MT_PING_BIT | MT_CALLREQ_BIT | MT_RESULT_BIT| MT_EXCEPTION_BIT);
@@ -876,7 +1637,9 @@ receive:
 			} else {
 				raise_execution_error("SPI process_SPI_results failed.");
 			}
-			break;
+			/* the error reply is not a result, it must not be read as one */
+			free_error((plcMsgError *) resp);
+			return NULL;
 		case MT_RESULT:
 			break;
 		default:
@@ -884,7 +1647,27 @@ receive:
 			return NULL;
 	}
 
-	result = (plcMsgResult *) resp;
+	return (plcMsgResult *) resp;
+}
+
+/*
+ * common function for SPI exec and SPI execp to extract returned results
+ */
+static SEXP process_SPI_results() {
+	plcMsgResult *result;
+	SEXP r_result = NULL,
+		names,
+		row_names,
+		fldvec;
+
+	uint32 j;
+
+	char buf[256];
+
+	result = receive_SPI_result();
+	if (result == NULL) {
+		return NULL;
+	}
 
 	/*
 	 * If result->cols=0, it should be the INSERT, UPDATE or DELETE statment
@@ -926,20 +1709,15 @@ receive:
 
 		/*
 		 * create a vector of the type that is rows long
-		 * For type BYTEA, we process it as TEXT
+		 * For type BYTEA, a list with one value per row
 		 */
 		if (result->types[j].type == PLC_DATA_BYTEA) {
-			PROTECT(fldvec = get_r_vector(PLC_DATA_TEXT, result->rows));
+			PROTECT(fldvec = allocVector(VECSXP, result->rows));
 		} else {
 			PROTECT(fldvec = get_r_vector(result->types[j].type, result->rows));
 		}
 
-		for (i = 0; i < result->rows; i++) {
-			/*
-			 * store the value
-			 */
-			pg_get_one_r(result->data[i][j].value, result->types[j].type, &fldvec, i);
-		}
+		get_spi_column_filler(result->types[j].type)(result, j, fldvec);
 
 		UNPROTECT(1);
 		SET_VECTOR_ELT(r_result, j, fldvec);
@@ -948,13 +1726,13 @@ receive:
 	/* attach the column names */
 	setAttrib(r_result, R_NamesSymbol, names);
 
-	/* attach row names - basically just the row number, zero based */
-	PROTECT(row_names = allocVector(STRSXP, result->rows));
-
-	for (i = 0; i < result->rows; i++) {
-		sprintf(buf, "%d", i + 1);
-		SET_STRING_ELT(row_names, i, COPY_TO_USER_STRING(buf));
-	}
+	/*
+	 * attach row names - just the row numbers, in the compact c(NA, -rows)
+	 * form R uses for automatic row names
+	 */
+	PROTECT(row_names = allocVector(INTSXP, 2));
+	INTEGER(row_names)[0] = NA_INTEGER;
+	INTEGER(row_names)[1] = -((int) result->rows);
 
 	setAttrib(r_result, R_RowNamesSymbol, row_names);
 
@@ -977,7 +1755,6 @@ receive:
  */
 SEXP plr_SPI_exec(SEXP rsql) {
 	const char *sql;
-	plcMsgSQL *msg;
 
 	PROTECT(rsql = AS_CHARACTER(rsql));
 	sql = CHAR(STRING_ELT(rsql, 0));
@@ -988,11 +1765,37 @@ SEXP plr_SPI_exec(SEXP rsql) {
 		return NULL;
 	}
 
+	return spi_exec_statement(sql);
+}
+
+static SEXP spi_exec_statement(const char *sql) {
 	/* If the execution was terminated we don't need to proceed with SPI */
 	if (plc_is_execution_terminated != 0) {
 		return NULL;
 	}
 
+	/* results come back in order, the submitted statements are answered first */
+	spi_receive_pending(-1);
+
+	spi_send_statement(sql);
+
+	return process_SPI_results();
+}
+
+/*
+ * Send an SPI request. The messages the function logged so far go first,
+ * so the backend sees them before the statement runs.
+ */
+static void spi_channel_send(plcConn *conn, plcMessage *msg) {
+	plr_log_flush();
+	plcontainer_channel_send(conn, msg);
+}
+
+static void spi_send_statement(const char *sql) {
+	plcMsgSQL *msg;
+
+	flush_unprepared_plans();
+
 	msg = pmalloc(sizeof(plcMsgSQL));
 	msg->msgtype = MT_SQL;
 	msg->sqltype = SQL_TYPE_STATEMENT;
@@ -1003,13 +1806,355 @@ SEXP plr_SPI_exec(SEXP rsql) {
 	 */
 	msg->statement = (char *) sql;
 
-	plcontainer_channel_send(plcconn_global, (plcMessage *) msg);
+	spi_channel_send(plcconn_global, (plcMessage *) msg);
 
 	/* we don't need it anymore */
 	pfree(msg);
+}
 
-	return process_SPI_results();
+/*
+ * Receive the results of statements the current call submitted in the order
+ * they were sent, until the one with the given id has arrived, or all of
+ * them for -1
+ */
+static void spi_receive_pending(int id) {
+	spi_request *req;
+
+	for (req = spi_requests; req != NULL && spi_inflight > 0; req = req->next) {
+		SEXP result;
+
+		if (req->id < spi_call_first_request) {
+			continue;
+		}
+		if (req->received) {
+			if (req->id == id) {
+				break;
+			}
+			continue;
+		}
+		if (plc_is_execution_terminated != 0) {
+			break;
+		}
+
+		result = process_SPI_results();
+		req->result = (result == NULL) ? R_NilValue : result;
+		R_PreserveObject(req->result);
+		req->received = 1;
+		spi_inflight -= 1;
+
+		if (req->id == id) {
+			break;
+		}
+	}
+}
+
+/*
+ * Forget the statements submitted since first_id, their results are read
+ * first so that the next reply belongs to the next request
+ */
+static void spi_release_requests(int first_id) {
+	spi_request **link = &spi_requests;
+
+	spi_receive_pending(-1);
+
+	while (*link != NULL) {
+		spi_request *req = *link;
+
+		if (req->id < first_id) {
+			link = &req->next;
+			continue;
+		}
+
+		*link = req->next;
+		if (req->received) {
+			R_ReleaseObject(req->result);
+		} else {
+			spi_inflight -= 1;
+		}
+		free(req);
+	}
+}
+
+static int spi_requests_oldest_inflight(void) {
+	spi_request *req;
+
+	for (req = spi_requests; req != NULL; req = req->next) {
+		if (!req->received && req->id >= spi_call_first_request) {
+			return req->id;
+		}
+	}
+	return -1;
+}
 
+/*
+ * plr_SPI_submit - Send a query without waiting for its result. Returns a
+ * handle for plr_SPI_collect, several queries may be in flight at once.
+ */
+SEXP plr_SPI_submit(SEXP rsql) {
+	const char *sql;
+	spi_request *req, **link;
+
+	PROTECT(rsql = AS_CHARACTER(rsql));
+	if (length(rsql) != 1 || STRING_ELT(rsql, 0) == NA_STRING) {
+		UNPROTECT(1);
+		raise_execution_error("R client cannot execute empty query");
+		return R_NilValue;
+	}
+	sql = CHAR(STRING_ELT(rsql, 0));
+
+	if (plc_is_execution_terminated != 0) {
+		UNPROTECT(1);
+		return R_NilValue;
+	}
+
+	/* bound the replies queued in the socket, the backend blocks on a full one */
+	if (spi_inflight >= r_spi_max_inflight) {
+		spi_receive_pending(spi_requests_oldest_inflight());
+	}
+
+	req = (spi_request *) malloc(sizeof(spi_request));
+	req->id = spi_next_request_id++;
+	req->result = R_NilValue;
+	req->received = 0;
+	req->next = NULL;
+
+	for (link = &spi_requests; *link != NULL; link = &(*link)->next);
+	*link = req;
+
+	spi_send_statement(sql);
+	spi_inflight += 1;
+	UNPROTECT(1);
+
+	return ScalarInteger(req->id);
+}
+
+/*
+ * plr_SPI_collect - Wait for the result of a query sent by plr_SPI_submit
+ */
+SEXP plr_SPI_collect(SEXP rhandle) {
+	int id = asInteger(rhandle);
+	spi_request *req, **link;
+	SEXP result;
+
+	for (link = &spi_requests; *link != NULL && (*link)->id != id; link = &(*link)->next);
+	req = *link;
+	if (req == NULL) {
+		raise_execution_error("SPI handle %d is unknown or already collected", id);
+		return R_NilValue;
+	}
+	if (id < spi_call_first_request) {
+		raise_execution_error("SPI handle %d belongs to an outer function call", id);
+		return R_NilValue;
+	}
+
+	spi_receive_pending(id);
+	if (!req->received) {
+		/* the execution was terminated before the result arrived */
+		return R_NilValue;
+	}
+
+	*link = req->next;
+	PROTECT(result = req->result);
+	R_ReleaseObject(result);
+	free(req);
+	UNPROTECT(1);
+
+	return result;
+}
+
+/*
+ * Run a cursor command, the %s in format is replaced by the quoted cursor name
+ */
+static SEXP spi_cursor_command(SEXP rname, const char *format, const char *arg) {
+	const char *name;
+	char *ident, *cmd, *p;
+	size_t len;
+	SEXP res;
+
+	PROTECT(rname = AS_CHARACTER(rname));
+	if (length(rname) != 1 || STRING_ELT(rname, 0) == NA_STRING) {
+		UNPROTECT(1);
+		raise_execution_error("cursor name must be a single string");
+		return R_NilValue;
+	}
+	name = CHAR(STRING_ELT(rname, 0));
+
+	/* quote the name as an SQL identifier, doubling embedded quotes */
+	ident = p = pmalloc(2 * strlen(name) + 3);
+	*p++ = '"';
+	for (; *name != '\0'; name++) {
+		if (*name == '"') {
+			*p++ = '"';
+		}
+		*p++ = *name;
+	}
+	*p++ = '"';
+	*p = '\0';
+	UNPROTECT(1);
+
+	len = strlen(format) + strlen(ident) + strlen(arg) + 1;
+	cmd = pmalloc(len);
+	snprintf(cmd, len, format, ident, arg);
+	pfree(ident);
+
+	res = spi_exec_statement(cmd);
+	pfree(cmd);
+
+	return res;
+}
+
+/*
+ * plr_SPI_cursor_open - Declare a cursor over a query. The rows are read
+ * with plr_SPI_cursor_fetch so that large results need not fit in memory.
+ * Cursors live until closed or until the end of the transaction.
+ */
+SEXP plr_SPI_cursor_open(SEXP rname, SEXP rsql) {
+	const char *sql;
+
+	PROTECT(rsql = AS_CHARACTER(rsql));
+	if (length(rsql) != 1 || STRING_ELT(rsql, 0) == NA_STRING) {
+		UNPROTECT(1);
+		raise_execution_error("R client cannot execute empty query");
+		return R_NilValue;
+	}
+	sql = CHAR(STRING_ELT(rsql, 0));
+
+	spi_cursor_command(rname, "DECLARE %s CURSOR FOR %s", sql);
+	UNPROTECT(1);
+
+	return rname;
+}
+
+/*
+ * plr_SPI_cursor_fetch - Fetch the next rows of a cursor as a data.frame,
+ * NULL once the cursor is exhausted
+ */
+SEXP plr_SPI_cursor_fetch(SEXP rname, SEXP rforward, SEXP rrows) {
+	char arg[32];
+	int rows;
+
+	rows = asInteger(rrows);
+	if (rows == NA_INTEGER || rows <= 0) {
+		raise_execution_error("number of rows to fetch must be positive");
+		return R_NilValue;
+	}
+
+	snprintf(arg, sizeof(arg), "%s %d", asLogical(rforward) == FALSE ? "BACKWARD" : "FORWARD", rows);
+	return spi_cursor_command(rname, "FETCH %2$s FROM %1$s", arg);
+}
+
+/*
+ * plr_SPI_cursor_close - Close a cursor opened by plr_SPI_cursor_open
+ */
+SEXP plr_SPI_cursor_close(SEXP rname) {
+	spi_cursor_command(rname, "CLOSE %s", "");
+	return R_NilValue;
+}
+
+static void release_saved_plan(r_saved_plan *r_plan) {
+	r_plan->refcount -= 1;
+	if (r_plan->refcount > 0) {
+		return;
+	}
+
+	r_plan->next = unprepared_plans;
+	unprepared_plans = r_plan;
+}
+
+/*
+ * Send SQL_TYPE_UNPREPARE for the released plans. Finalizers run inside
+ * the R garbage collector, so the message is not sent from there but from
+ * the SPI entry points and before the call result, when the backend is
+ * waiting for our next request.
+ */
+static void flush_unprepared_plans(void) {
+	plcMsgSQL msg;
+
+	if (plc_is_execution_terminated != 0) {
+		return;
+	}
+
+	while (unprepared_plans != NULL) {
+		r_saved_plan *r_plan = unprepared_plans;
+
+		unprepared_plans = r_plan->next;
+
+		msg.msgtype = MT_SQL;
+		msg.sqltype = SQL_TYPE_UNPREPARE;
+		msg.pplan = r_plan->pplan;
+		msg.statement = NULL;
+		msg.limit = 0;
+		msg.nargs = 0;
+		msg.args = NULL;
+		spi_channel_send(plcconn_global, (plcMessage *) &msg);
+
+		free(r_plan->argtypes);
+		free(r_plan->outfuncs);
+		free(r_plan->typeoids);
+		free(r_plan->query);
+		free(r_plan);
+	}
+}
+
+static void saved_plan_finalizer(SEXP ptr) {
+	r_saved_plan *r_plan = (r_saved_plan *) R_ExternalPtrAddr(ptr);
+
+	if (r_plan != NULL) {
+		R_ClearExternalPtr(ptr);
+		release_saved_plan(r_plan);
+	}
+}
+
+static SEXP make_saved_plan_ptr(r_saved_plan *r_plan) {
+	SEXP ptr;
+
+	r_plan->refcount += 1;
+	PROTECT(ptr = R_MakeExternalPtr(r_plan, R_NilValue, R_NilValue));
+	R_RegisterCFinalizer(ptr, saved_plan_finalizer);
+	UNPROTECT(1);
+
+	return ptr;
+}
+
+static r_saved_plan *spi_plan_cache_get(const char *query, int nargs, const int *typeoids) {
+	int i;
+
+	for (i = 0; i < SPI_PLAN_CACHE_SIZE; i++) {
+		r_saved_plan *r_plan = spi_plan_cache[i];
+
+		if (r_plan != NULL && r_plan->nargs == nargs
+		    && strcmp(r_plan->query, query) == 0
+		    && (nargs == 0 || memcmp(r_plan->typeoids, typeoids, nargs * sizeof(int)) == 0)) {
+			r_plan->lastused = ++spi_plan_cache_clock;
+			return r_plan;
+		}
+	}
+
+	return NULL;
+}
+
+static void spi_plan_cache_put(r_saved_plan *r_plan) {
+	int i;
+	int victim = 0;
+
+	for (i = 0; i < SPI_PLAN_CACHE_SIZE; i++) {
+		if (spi_plan_cache[i] == NULL) {
+			victim = i;
+			break;
+		}
+		if (spi_plan_cache[i]->lastused < spi_plan_cache[victim]->lastused) {
+			victim = i;
+		}
+	}
+
+	if (spi_plan_cache[victim] != NULL) {
+		plc_elog(DEBUG1, "SPI plan cache is full, evicting plan of \"%s\"", spi_plan_cache[victim]->query);
+		release_saved_plan(spi_plan_cache[victim]);
+	}
+
+	r_plan->refcount += 1;
+	r_plan->lastused = ++spi_plan_cache_clock;
+	spi_plan_cache[victim] = r_plan;
 }
 
 /*
@@ -1023,14 +2168,15 @@ SEXP plr_SPI_prepare(SEXP rsql, SEXP rargtypes) {
 	plcConn *conn = plcconn_global;
 	r_saved_plan *r_plan;
 
-	SEXP r_result;
-
 	plcMsgSQL msg;
 	plcMessage *resp;
 
 	char *start;
+	double wait_start;
 	int offset = 0, tx_len = 0;
 	int is_plan_valid;
+	int *typeoids;
+	void *pplan;
 
 	PROTECT(rsql = AS_CHARACTER(rsql));
 	query = CHAR(STRING_ELT(rsql, 0));
@@ -1057,6 +2203,17 @@ SEXP plr_SPI_prepare(SEXP rsql, SEXP rargtypes) {
 		raise_execution_error("second parameter must be a vector of PostgreSQL datatypes");
 	}
 
+	r_plan = spi_plan_cache_get(query, nargs, INTEGER(rargtypes));
+	if (r_plan != NULL) {
+		UNPROTECT(1);
+		return make_saved_plan_ptr(r_plan);
+	}
+
+	spi_receive_pending(-1);
+	flush_unprepared_plans();
+
+	typeoids = (nargs > 0) ? malloc(nargs * sizeof(int)) : NULL;
+
 	msg.msgtype = MT_SQL;
 	msg.sqltype = SQL_TYPE_PREPARE;
 	msg.nargs = nargs;
@@ -1065,50 +2222,70 @@ SEXP plr_SPI_prepare(SEXP rsql, SEXP rargtypes) {
 
 	for (i = 0; i < nargs; i++) {
 		char typeid[TYPE_ID_LENGTH];
+		typeoids[i] = INTEGER(rargtypes)[i];
 		sprintf(typeid, "%d", INTEGER(rargtypes)[i]);
 		fill_prepare_argument(&msg.args[i], typeid, PLC_DATA_INT4);
 	}
 
 	UNPROTECT(1);
 
-	plcontainer_channel_send(conn, (plcMessage *) &msg);
+	spi_channel_send(conn, (plcMessage *) &msg);
 	free_arguments(msg.args, msg.nargs, false, false);
 
+	wait_start = plc_r_clock_ms();
 	res = plcontainer_channel_receive(conn, &resp, MT_RAW_BIT | MT_EXCEPTION_BIT);
+	record_spi_wait(wait_start);
 
-	if (resp->msgtype == MT_EXCEPTION) {
-			if (((plcMsgError *) resp)->message != NULL) {
-				raise_execution_error("SPI process_SPI_results failed due to %s", ((plcMsgError *) resp)->message);
-			} else {
-				raise_execution_error("SPI process_SPI_results failed.");
-			}
-	}
 	if (res < 0) {
 		raise_execution_error("Error receiving data from the frontend, %d", res);
+		free(typeoids);
+		return NULL;
+	}
+	if (resp->msgtype == MT_EXCEPTION) {
+		if (((plcMsgError *) resp)->message != NULL) {
+			raise_execution_error("SPI process_SPI_results failed due to %s", ((plcMsgError *) resp)->message);
+		} else {
+			raise_execution_error("SPI process_SPI_results failed.");
+		}
+		/* the error reply carries no plan */
+		free_error((plcMsgError *) resp);
+		free(typeoids);
 		return NULL;
 	}
 
 	start = ((plcMsgRaw *) resp)->data;
 	tx_len = ((plcMsgRaw *) resp)->size;
 
-	r_plan = (r_saved_plan *) malloc(sizeof(r_saved_plan));
 	is_plan_valid = (*((int32 *) (start + offset)));
 	offset += sizeof(int32);
 
 	if (!is_plan_valid) {
 		raise_execution_error("plpy.prepare failed. See backend for details.");
+		free(typeoids);
 		return NULL;
 	}
 
-	r_plan->pplan = (int64 *) (*((long long *) (start + offset)));
+	pplan = (int64 *) (*((long long *) (start + offset)));
 	offset += sizeof(int64);
+
+	r_plan = (r_saved_plan *) malloc(sizeof(r_saved_plan));
+	r_plan->pplan = pplan;
 	r_plan->nargs = *((int *) (start + offset));
+	r_plan->query = strdup(query);
+	r_plan->typeoids = typeoids;
+	r_plan->argtypes = NULL;
+	r_plan->outfuncs = NULL;
+	r_plan->refcount = 0;
+	r_plan->lastused = 0;
+	r_plan->next = NULL;
 	offset += sizeof(int32);
 
 
 	if (r_plan->nargs != nargs) {
 		raise_execution_error("plpy.prepare: bad argument number: %d "
 			                      "(returned) vs %d (expected).", r_plan->nargs, nargs);
+		r_plan->refcount = 1;
+		release_saved_plan(r_plan);
 		return NULL;
 	}
 
@@ -1117,6 +2294,8 @@ SEXP plr_SPI_prepare(SEXP rsql, SEXP rargtypes) {
 			raise_execution_error("Client format error for spi prepare. "
 				                      "calculated length (%d) vs transferred length (%d)",
 			                      offset + sizeof(plcDatatype) * nargs, tx_len);
+			r_plan->refcount = 1;
+			release_saved_plan(r_plan);
 			return NULL;
 		}
 
@@ -1124,16 +2303,23 @@ SEXP plr_SPI_prepare(SEXP rsql, SEXP rargtypes) {
 		if (r_plan->argtypes == NULL) {
 			raise_execution_error("Could not allocate %d bytes for argtypes"
 				                      " in py_plan", sizeof(plcDatatype) * nargs);
+			r_plan->refcount = 1;
+			release_saved_plan(r_plan);
 			return NULL;
 		}
 		memcpy(r_plan->argtypes, start + offset, sizeof(plcDatatype) * nargs);
-	}
 
-	r_result = R_MakeExternalPtr(r_plan, R_NilValue, R_NilValue);
+		r_plan->outfuncs = malloc(sizeof(plcROutputFunc) * nargs);
+		for (i = 0; i < nargs; i++) {
+			r_plan->outfuncs[i] = plc_get_output_function(r_plan->argtypes[i]);
+		}
+	}
 
 	free_rawmsg((plcMsgRaw *) resp);
 
-	return r_result;
+	spi_plan_cache_put(r_plan);
+
+	return make_saved_plan_ptr(r_plan);
 }
 
 /*
@@ -1143,6 +2329,7 @@ SEXP plr_SPI_execp(SEXP rsaved_plan, SEXP rargvalues) {
 	r_saved_plan *r_plan = (r_saved_plan *) R_ExternalPtrAddr(rsaved_plan);
 	plcArgument *args;
 	plcMsgSQL msg;
+	plcRArenaMark mark;
 
 
 	int nargs, i;
@@ -1155,7 +2342,8 @@ SEXP plr_SPI_execp(SEXP rsaved_plan, SEXP rargvalues) {
 	}
 
 	nargs = r_plan->nargs;
-	args = pmalloc(sizeof(plcArgument) * nargs);
+	mark = plc_r_arena_begin();
+	args = plc_r_conv_alloc(sizeof(plcArgument) * nargs);
 	if (nargs > 0) {
 		if (!Rf_isVectorList(rargvalues)) {
 			raise_execution_error("second parameter must be a list of arguments to the prepared plan");
@@ -1179,7 +2367,7 @@ SEXP plr_SPI_execp(SEXP rsaved_plan, SEXP rargvalues) {
 
 		if (obj != NULL && !isNull(obj) && obj != R_NilValue) {
 			args[i].data.isnull = 0;
-			plc_get_output_function(r_plan->argtypes[i])(obj, &args[i].data.value, NULL);
+			r_plan->outfuncs[i](obj, &args[i].data.value, NULL);
 		} else {
 			/* follow python client */
 			args[i].data.isnull = 1;
@@ -1189,6 +2377,9 @@ SEXP plr_SPI_execp(SEXP rsaved_plan, SEXP rargvalues) {
 		UNPROTECT(1);
 	}
 
+	spi_receive_pending(-1);
+	flush_unprepared_plans();
+
 	msg.msgtype = MT_SQL;
 	msg.sqltype = SQL_TYPE_PEXECUTE;
 	msg.pplan = r_plan->pplan;
@@ -1196,12 +2387,164 @@ SEXP plr_SPI_execp(SEXP rsaved_plan, SEXP rargvalues) {
 	msg.nargs = nargs;
 	msg.args = args;
 
-	plcontainer_channel_send(plcconn_global, (plcMessage *) &msg);
-	free_arguments(args, nargs, false, false);
+	spi_channel_send(plcconn_global, (plcMessage *) &msg);
+	plc_r_arena_end(mark);
 
 	return process_SPI_results();
 }
 
+/*
+ * Coerce a bulk argument column to the R type plc_r_vector_element expects
+ * for the plan argument, e.g. the double literals of R bound to int4. bytea
+ * columns are lists, every value goes through the plan's output function.
+ */
+static SEXP bulk_column(SEXP column, plcDatatype type) {
+	switch (type) {
+		case PLC_DATA_INT1:
+			return coerceVector(column, LGLSXP);
+		case PLC_DATA_INT2:
+		case PLC_DATA_INT4:
+			return coerceVector(column, INTSXP);
+		case PLC_DATA_INT8:
+		case PLC_DATA_FLOAT4:
+		case PLC_DATA_FLOAT8:
+			return coerceVector(column, REALSXP);
+		case PLC_DATA_BYTEA:
+			return column;
+		default:
+			return coerceVector(column, STRSXP);
+	}
+}
+
+/*
+ * plr_SPI_execp_bulk - Execute a prepared plan once for every row of a
+ * data.frame or a list of equally long argument vectors. The executions
+ * are pipelined, at most RCLIENT_SPI_MAX_INFLIGHT are unanswered at a
+ * time. Returns the total number of rows processed.
+ */
+SEXP plr_SPI_execp_bulk(SEXP rsaved_plan, SEXP rargcolumns) {
+	r_saved_plan *r_plan = (r_saved_plan *) R_ExternalPtrAddr(rsaved_plan);
+	plcRType *types;
+	plcArgument *args;
+	plcMsgSQL msg;
+	plcMsgResult *result;
+	plcRArenaMark mark;
+	SEXP columns, column;
+	int nargs, nrows, row, i;
+	int failed = 0;
+	int inflight = 0;
+	double processed = 0;
+
+	if (r_plan == NULL) {
+		raise_execution_error("SPI plan does not found");
+		return R_NilValue;
+	}
+
+	nargs = r_plan->nargs;
+	if (!Rf_isVectorList(rargcolumns) || length(rargcolumns) != nargs) {
+		raise_execution_error("second parameter must be a data.frame or a list of %d argument vectors", nargs);
+		return R_NilValue;
+	}
+
+	nrows = (nargs > 0) ? length(VECTOR_ELT(rargcolumns, 0)) : 0;
+	for (i = 0; i < nargs; i++) {
+		if (length(VECTOR_ELT(rargcolumns, i)) != nrows) {
+			raise_execution_error("argument vectors must all have %d values", nrows);
+			return R_NilValue;
+		}
+		if (r_plan->argtypes[i] == PLC_DATA_ARRAY || r_plan->argtypes[i] == PLC_DATA_UDT) {
+			raise_execution_error("bulk execution cannot handle arguments of type %s",
+			                      plc_get_type_name(r_plan->argtypes[i]));
+			return R_NilValue;
+		}
+		if (r_plan->argtypes[i] == PLC_DATA_BYTEA && TYPEOF(VECTOR_ELT(rargcolumns, i)) != VECSXP) {
+			raise_execution_error("bytea argument vector %d must be a list", i + 1);
+			return R_NilValue;
+		}
+	}
+
+	if (plc_is_execution_terminated != 0) {
+		return R_NilValue;
+	}
+
+	/* factors are sent as their levels, type mismatches fail before anything is sent */
+	PROTECT(columns = frame_columns(rargcolumns));
+	for (i = 0; i < nargs; i++) {
+		SET_VECTOR_ELT(columns, i, bulk_column(VECTOR_ELT(columns, i), r_plan->argtypes[i]));
+	}
+
+	spi_receive_pending(-1);
+	flush_unprepared_plans();
+
+	types = (plcRType *) calloc(nargs > 0 ? nargs : 1, sizeof(plcRType));
+	for (i = 0; i < nargs; i++) {
+		types[i].type = r_plan->argtypes[i];
+	}
+
+	msg.msgtype = MT_SQL;
+	msg.sqltype = SQL_TYPE_PEXECUTE;
+	msg.pplan = r_plan->pplan;
+	msg.limit = 0;
+	msg.nargs = nargs;
+
+	for (row = 0; row < nrows && plc_is_execution_terminated == 0; row++) {
+		if (inflight >= r_spi_max_inflight) {
+			result = receive_SPI_result();
+			inflight -= 1;
+			if (result == NULL) {
+				break;
+			}
+			processed += result->rows;
+			free_result(result, false);
+		}
+
+		mark = plc_r_arena_begin();
+		args = plc_r_conv_alloc(sizeof(plcArgument) * (nargs > 0 ? nargs : 1));
+		for (i = 0; i < nargs && !failed; i++) {
+			args[i].type.type = r_plan->argtypes[i];
+			args[i].name = NULL; /* We do not need name */
+			args[i].type.nSubTypes = 0;
+			args[i].type.typeName = NULL;
+
+			column = VECTOR_ELT(columns, i);
+			if (types[i].type != PLC_DATA_BYTEA) {
+				failed = plc_r_vector_element(column, row, &types[i], &args[i].data);
+			} else if (VECTOR_ELT(column, row) == R_NilValue) {
+				args[i].data.isnull = 1;
+				args[i].data.value = NULL;
+			} else {
+				args[i].data.isnull = 0;
+				failed = r_plan->outfuncs[i](VECTOR_ELT(column, row), &args[i].data.value, NULL);
+			}
+		}
+		if (failed) {
+			/* the error is raised, the row is not sent */
+			plc_r_arena_end(mark);
+			break;
+		}
+		msg.args = args;
+
+		spi_channel_send(plcconn_global, (plcMessage *) &msg);
+		plc_r_arena_end(mark);
+		inflight += 1;
+	}
+
+	/* every execution sent is answered, read the replies even after an error */
+	while (inflight > 0) {
+		result = receive_SPI_result();
+		inflight -= 1;
+		if (result != NULL) {
+			processed += result->rows;
+			free_result(result, false);
+		}
+	}
+
+	UNPROTECT(1);
+	free(types);
+
+	return ScalarReal(processed);
+}
+
 void raise_execution_error(const char *format, ...) {
 	char *msg = NULL;
 
@@ -1244,6 +2587,8 @@ void raise_execution_error(const char *format, ...) {
 void plc_raise_delayed_error(plcConn *conn) {
 	if (plcLastErrMessage != NULL) {
 		if (plc_is_execution_terminated == 0 && conn != NULL) {
+			/* the messages logged before the error go first */
+			plr_log_flush();
 			plcontainer_channel_send(conn, (plcMessage *) plcLastErrMessage);
 			free_error(plcLastErrMessage);
 			plcLastErrMessage = NULL;
@@ -1254,6 +2599,32 @@ void plc_raise_delayed_error(plcConn *conn) {
 	}
 }
 
+int plc_r_getenv_int(const char *name, int defval) {
+	char *value = getenv(name);
+	char *end;
+	long res;
+
+	if (value == NULL || *value == '\0') {
+		return defval;
+	}
+
+	errno = 0;
+	res = strtol(value, &end, 10);
+	if (errno != 0 || *end != '\0' || res > INT_MAX || res < INT_MIN) {
+		plc_elog(WARNING, "Invalid value \"%s\" of %s, using %d", value, name, defval);
+		return defval;
+	}
+
+	return (int) res;
+}
+
+double plc_r_clock_ms(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
 void throw_pg_notice(const char **msg) {
 	if (msg && *msg)
 		last_R_notice = strdup(*msg);
@@ -24,8 +24,17 @@ void handle_call(plcMsgCallreq *req, plcConn *conn);
 // Initialization of R module
 int r_init(void);
 
+// Initialization of R module for programs linking it statically, e.g. the converter benchmarks
+int r_init_linked(void);
+
 void raise_execution_error(const char *format, ...);
 
 void plc_raise_delayed_error(plcConn *conn);
 
+// Read an integer setting from the environment, defval if unset or malformed
+int plc_r_getenv_int(const char *name, int defval);
+
+// Monotonic clock in milliseconds, used for timing instrumentation
+double plc_r_clock_ms(void);
+
 #endif /* PLC_RCALL_H */
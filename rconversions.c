@@ -4,8 +4,13 @@
  *
  *------------------------------------------------------------------------------
  */
+
 #include "rconversions.h"
 #include "rcall.h"
+#include "rcache.h"
+#include "rarena.h"
+#include "raltrep.h"
+#include "rshm.h"
 #include "common/comm_channel.h"
 
 static SEXP plc_r_object_from_int1(char *input, plcRType *type);
@@ -54,8 +59,15 @@ static int plc_r_object_as_bytea(SEXP input, char **output, plcRType *type);
 
 static void plc_r_object_iter_free(plcIterator *iter);
 
+static void plc_r_object_iter_noop(plcIterator *iter);
+
 static rawdata *plc_r_object_as_array_next(plcIterator *iter);
 
+static rawdata *plc_r_object_as_array_next_fixed(plcIterator *iter);
+
+static void plc_r_encode_fixed(SEXP input, size_t first, size_t count, plcDatatype type,
+                               char *values, char *nulls);
+
 static plcRInputFunc plc_get_input_function(plcDatatype dt, bool isArrayElement);
 
 static void plc_parse_type(plcRType *Rtype, plcType *type, char *argName, bool isArrayElement);
@@ -104,16 +116,264 @@ static SEXP plc_r_object_from_float8(char *input, plcRType *type UNUSED) {
 	return arg;
 }
 
+/* bytes of the text values converted to R, mkChar would measure them anyway */
+static size_t text_bytes_converted = 0;
+
+size_t plc_r_text_bytes_converted(void) {
+	return text_bytes_converted;
+}
+
+/*
+ * bytes of the values encoded for the backend, the payload of results and
+ * SPI arguments without the iterators, types and names around them
+ */
+static size_t bytes_encoded = 0;
+
+size_t plc_r_bytes_encoded(void) {
+	return bytes_encoded;
+}
+
+/* Room for an encoded value of size bytes */
+static char *plc_r_value_alloc(size_t size) {
+	bytes_encoded += size;
+	return (char *) plc_r_conv_alloc(size);
+}
+
+/* Copy of a CHARSXP, its length is known without strlen */
+static char *plc_r_value_text(SEXP chr) {
+	size_t len = (size_t) LENGTH(chr) + 1;
+	char *res = plc_r_value_alloc(len);
+
+	memcpy(res, CHAR(chr), len);
+	return res;
+}
+
 static SEXP plc_r_object_from_text(char *input, plcRType *type UNUSED) {
 	SEXP arg;
-	PROTECT(arg = mkString(input));
+	int len = (int) strlen(input);
+
+	text_bytes_converted += len;
+	PROTECT(arg = ScalarString(mkCharLen(input, len)));
 	return arg;
 }
 
 static SEXP plc_r_object_from_text_ptr(char *input, plcRType *type UNUSED) {
-	SEXP arg;
-	PROTECT(arg = mkString(*((char **) input)));
-	return arg;
+	return plc_r_object_from_text(*((char **) input), type);
+}
+
+/*
+ * Copy a fixed-width array straight into the R vector, nulls become NA.
+ * Returns 0 if the element type has to go through the input functions.
+ */
+static int plc_r_array_fill_fixed(plcArray *arr, int arr_length, SEXP res) {
+	int i;
+
+	switch (arr->meta->type) {
+		case PLC_DATA_INT1: {
+			int8 *src = (int8 *) arr->data;
+			int *dst = LOGICAL_DATA(res);
+
+			for (i = 0; i < arr_length; i++) {
+				dst[i] = arr->nulls[i] ? NA_LOGICAL : (int) src[i];
+			}
+			break;
+		}
+		case PLC_DATA_INT2: {
+			int16 *src = (int16 *) arr->data;
+			int *dst = INTEGER_DATA(res);
+
+			for (i = 0; i < arr_length; i++) {
+				dst[i] = arr->nulls[i] ? NA_INTEGER : (int) src[i];
+			}
+			break;
+		}
+		case PLC_DATA_INT4: {
+			int *dst = INTEGER_DATA(res);
+
+			memcpy(dst, arr->data, arr_length * sizeof(int));
+			for (i = 0; i < arr_length; i++) {
+				if (arr->nulls[i]) {
+					dst[i] = NA_INTEGER;
+				}
+			}
+			break;
+		}
+		case PLC_DATA_INT8: {
+			int64 *src = (int64 *) arr->data;
+			double *dst = NUMERIC_DATA(res);
+
+			for (i = 0; i < arr_length; i++) {
+				dst[i] = arr->nulls[i] ? NA_REAL : (double) src[i];
+			}
+			break;
+		}
+		case PLC_DATA_FLOAT4: {
+			float4 *src = (float4 *) arr->data;
+			double *dst = NUMERIC_DATA(res);
+
+			for (i = 0; i < arr_length; i++) {
+				dst[i] = arr->nulls[i] ? NA_REAL : (double) src[i];
+			}
+			break;
+		}
+		case PLC_DATA_FLOAT8: {
+			double *dst = NUMERIC_DATA(res);
+
+			memcpy(dst, arr->data, arr_length * sizeof(double));
+			for (i = 0; i < arr_length; i++) {
+				if (arr->nulls[i]) {
+					dst[i] = NA_REAL;
+				}
+			}
+			break;
+		}
+		default:
+			return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * Convert the array elements one by one with the element input function
+ */
+static void plc_r_array_fill_elements(plcArray *arr, int arr_length, plcRType *elmtype, SEXP res) {
+	char *pos;
+	int vallen = 0;
+	int i;
+	plcRInputFunc infunc;
+
+	vallen = plc_get_type_length(elmtype->type);
+	infunc = elmtype->conv.inputfunc;
+
+	pos = arr->data;
+	for (i = 0; i < arr_length; i++) {
+		SEXP obj = NULL;
+
+		if (arr->nulls[i] == 0) {
+			/*
+			 * call the input function for the element in the array
+			 */
+			obj = infunc(pos, elmtype);
+		}
+		switch (arr->meta->type) {
+			/* 2 and 4 byte integer pgsql datatype => use R INTEGER */
+			case PLC_DATA_INT2:
+			case PLC_DATA_INT4:
+				if (arr->nulls[i] != 0) {
+					INTEGER_DATA(res)[i] = NA_INTEGER;
+				} else {
+					INTEGER_DATA(res)[i] = asInteger(obj);
+				}
+				break;
+
+				/*
+				 * Other numeric types => use R REAL
+				 * Note pgsql int8 is mapped to R REAL
+				 * because R INTEGER is only 4 byte
+				 */
+			case PLC_DATA_INT8:
+				if (arr->nulls[i] != 0) {
+					NUMERIC_DATA(res)[i] = NA_REAL;
+				} else {
+					NUMERIC_DATA(res)[i] = (float8) asReal(obj);
+				}
+				break;
+
+			case PLC_DATA_FLOAT4:
+				if (arr->nulls[i] != 0) {
+					NUMERIC_DATA(res)[i] = NA_REAL;
+				} else {
+					NUMERIC_DATA(res)[i] = (float4) asReal(obj);
+				}
+				break;
+
+			case PLC_DATA_FLOAT8:
+				if (arr->nulls[i] != 0) {
+					NUMERIC_DATA(res)[i] = NA_REAL;
+				} else {
+					NUMERIC_DATA(res)[i] = (float8) asReal(obj);
+				}
+				break;
+			case PLC_DATA_INT1:
+				if (arr->nulls[i] != 0) {
+					LOGICAL_DATA(res)[i] = NA_LOGICAL;
+				} else {
+					LOGICAL_DATA(res)[i] = asLogical(obj);
+				}
+				break;
+			case PLC_DATA_UDT:
+				if (arr->nulls[i] != 0) {
+					SET_VECTOR_ELT(res, i, R_NilValue);
+				} else {
+					SET_VECTOR_ELT(res, i, obj);
+				}
+				break;
+			case PLC_DATA_INVALID:
+			case PLC_DATA_ARRAY:
+			case PLC_DATA_BYTEA:
+				raise_execution_error("Arrays cannot handle elements of type %s [%d]",
+				                      plc_get_type_name(arr->meta->type),
+				                      arr->meta->type);
+				break;
+			case PLC_DATA_TEXT:
+			default:
+				/* Everything else is defaulted to string */
+				if (arr->nulls[i] != 0) {
+					SET_STRING_ELT(res, i, NA_STRING);
+				} else {
+					obj = STRING_ELT(obj, 0);
+					SET_STRING_ELT(res, i, obj);
+				}
+		}
+		/* move position to next element in the source array */
+		pos += vallen;
+
+		/* if it isn't a null we have protected it above */
+		if (arr->nulls[i] == 0) {
+			UNPROTECT(1);
+		}
+	}
+}
+
+/* set while the arguments of a call are converted, see plc_r_set_adopt_arrays */
+static bool adopt_arrays = false;
+
+void plc_r_set_adopt_arrays(bool adopt) {
+	adopt_arrays = adopt;
+}
+
+/*
+ * Large int4 and float8 arrays take over the buffer of the message, the
+ * nulls are written as NA in place. The message gets a dummy buffer to free.
+ */
+static SEXP plc_r_array_adopt(plcArray *arr, int arr_length) {
+	SEXP res;
+	int i;
+
+	if (!adopt_arrays || arr_length < PLC_R_ALTREP_MIN_ELEMENTS
+	    || (arr->meta->type != PLC_DATA_INT4 && arr->meta->type != PLC_DATA_FLOAT8)) {
+		return R_NilValue;
+	}
+
+	res = plc_r_altrep_wrap(arr->meta->type, arr->data, arr_length);
+	if (res == R_NilValue) {
+		return R_NilValue;
+	}
+
+	for (i = 0; i < arr_length; i++) {
+		if (arr->nulls[i] == 0) {
+			continue;
+		}
+		if (arr->meta->type == PLC_DATA_INT4) {
+			((int *) arr->data)[i] = NA_INTEGER;
+		} else {
+			((double *) arr->data)[i] = NA_REAL;
+		}
+	}
+	arr->data = pmalloc(1);
+
+	return res;
 }
 
 static SEXP plc_r_object_from_array(char *input, plcRType *type) {
@@ -123,11 +383,8 @@ static SEXP plc_r_object_from_array(char *input, plcRType *type) {
 	if (arr->meta->ndims == 0) {
 		PROTECT(res = get_r_vector(type->type, 0));
 	} else {
-		char *pos;
-		int vallen = 0;
 		int arr_length = 1;
 		int i;
-		plcRInputFunc infunc;
 		plcRType *elmtype;
 
 		/* calculate the length of the array */
@@ -135,100 +392,20 @@ static SEXP plc_r_object_from_array(char *input, plcRType *type) {
 			arr_length *= arr->meta->dims[i];
 		}
 
-		/* allocate a vector */
 		elmtype = &type->subTypes[0];
-		PROTECT(res = get_r_vector(elmtype->type, arr_length));
-		vallen = plc_get_type_length(elmtype->type);
-		infunc = plc_get_input_function(elmtype->type, true);
-
-		pos = arr->data;
-		for (i = 0; i < arr_length; i++) {
-			SEXP obj = NULL;
-
-			if (arr->nulls[i] == 0) {
-				/*
-				 * call the input function for the element in the array
-				 */
-				obj = infunc(pos, elmtype);
-			}
-			switch (arr->meta->type) {
-				/* 2 and 4 byte integer pgsql datatype => use R INTEGER */
-				case PLC_DATA_INT2:
-				case PLC_DATA_INT4:
-					if (arr->nulls[i] != 0) {
-						INTEGER_DATA(res)[i] = NA_INTEGER;
-					} else {
-						INTEGER_DATA(res)[i] = asInteger(obj);
-					}
-					break;
-
-					/*
-					 * Other numeric types => use R REAL
-					 * Note pgsql int8 is mapped to R REAL
-					 * because R INTEGER is only 4 byte
-					 */
-				case PLC_DATA_INT8:
-					if (arr->nulls[i] != 0) {
-						NUMERIC_DATA(res)[i] = NA_REAL;
-					} else {
-						NUMERIC_DATA(res)[i] = (float8) asReal(obj);
-					}
-					break;
-
-				case PLC_DATA_FLOAT4:
-					if (arr->nulls[i] != 0) {
-						NUMERIC_DATA(res)[i] = NA_REAL;
-					} else {
-						NUMERIC_DATA(res)[i] = (float4) asReal(obj);
-					}
-					break;
+		PROTECT(res = plc_r_array_adopt(arr, arr_length));
+		if (res == R_NilValue) {
+			UNPROTECT(1);
 
-				case PLC_DATA_FLOAT8:
-					if (arr->nulls[i] != 0) {
-						NUMERIC_DATA(res)[i] = NA_REAL;
-					} else {
-						NUMERIC_DATA(res)[i] = (float8) asReal(obj);
-					}
-					break;
-				case PLC_DATA_INT1:
-					if (arr->nulls[i] != 0) {
-						LOGICAL_DATA(res)[i] = NA_LOGICAL;
-					} else {
-						LOGICAL_DATA(res)[i] = asLogical(obj);
-					}
-					break;
-				case PLC_DATA_UDT:
-					if (arr->nulls[i] != 0) {
-						SET_VECTOR_ELT(res, i, R_NilValue);
-					} else {
-						SET_VECTOR_ELT(res, i, obj);
-					}
-					break;
-				case PLC_DATA_INVALID:
-				case PLC_DATA_ARRAY:
-				case PLC_DATA_BYTEA:
-					raise_execution_error("Arrays cannot handle elements of type %s [%d]",
-					                      plc_get_type_name(arr->meta->type),
-					                      arr->meta->type);
-					break;
-				case PLC_DATA_TEXT:
-				default:
-					/* Everything else is defaulted to string */
-					if (arr->nulls[i] != 0) {
-						SET_STRING_ELT(res, i, NA_STRING);
-					} else {
-						obj = STRING_ELT(obj, 0);
-						SET_STRING_ELT(res, i, obj);
-					}
-			}
-			/* move position to next element in the source array */
-			pos += vallen;
+			/* allocate a vector */
+			PROTECT(res = get_r_vector(elmtype->type, arr_length));
 
-			/* if it isn't a null we have protected it above */
-			if (arr->nulls[i] == 0) {
-				UNPROTECT(1);
+			/* numeric elements skip the per element scalars */
+			if (!plc_r_array_fill_fixed(arr, arr_length, res)) {
+				plc_r_array_fill_elements(arr, arr_length, elmtype, res);
 			}
 		}
+
 		if (arr->meta->ndims > 0) {
 			SEXP matrix_dims;
 
@@ -300,45 +477,159 @@ static SEXP plc_r_object_from_udt_ptr(char *input, plcRType *type) {
 	return plc_r_object_from_udt(*((char **) input), type);
 }
 
-static SEXP plc_r_object_from_bytea(char *input, plcRType *type UNUSED) {
-	SEXP result;
-	SEXP s, t, obj;
-	int status;
-	int bsize;
+/*
+ * bytea values are R objects in the serialize() format, preceded by their
+ * length. The R serialization API reads and writes the message buffer
+ * directly, no intermediate raw vector is built.
+ */
+/*
+ * Serialization buffer. Writing starts in the free shared memory if there is
+ * any and moves to a growing heap buffer once the value does not fit, so the
+ * object is serialized only once.
+ */
+typedef struct plcRSerialBuffer {
+	char *data;
+	size_t size;     /* readable bytes when unserializing, capacity when serializing */
+	size_t pos;
+	bool owned;      /* data is a heap buffer to free */
+} plcRSerialBuffer;
+
+typedef struct plcRSerialCall {
+	SEXP obj;
+	plcRSerialBuffer *buf;
+} plcRSerialCall;
 
-	bsize = *((int *) input);
-	PROTECT(obj = get_r_vector(PLC_DATA_BYTEA, bsize));
-	memcpy((char *) RAW(obj), input + 4, bsize);
+#define PLC_R_SERIAL_MIN_BUFFER (64 * 1024)
 
-	/*
-	 * Need to construct a call to
-	 * unserialize(rval)
-	 */
-	PROTECT(t = s = allocList(2));
-	SET_TYPEOF(s, LANGSXP);
-	SETCAR(t, install("unserialize"));
-	t = CDR(t);
-	SETCAR(t, obj);
+static void plc_r_serial_reserve(plcRSerialBuffer *buf, size_t len) {
+	size_t capacity;
+	char *data;
+
+	if (buf->pos + len <= buf->size) {
+		return;
+	}
 
-	PROTECT(result = R_tryEval(s, R_GlobalEnv, &status));
-	if (status != 0) {
-		if (last_R_error_msg) {
+	capacity = buf->size * 2;
+	if (capacity < buf->pos + len) {
+		capacity = buf->pos + len;
+	}
+	if (capacity < PLC_R_SERIAL_MIN_BUFFER) {
+		capacity = PLC_R_SERIAL_MIN_BUFFER;
+	}
 
-			raise_execution_error("R interpreter expression evaluation error: %s", last_R_error_msg);
-		} else {
-			raise_execution_error("R interpreter expression evaluation error: "
-				                      "R expression evaluation error caught in \"unserialize\".");
+	if (buf->owned) {
+		data = realloc(buf->data, capacity);
+	} else {
+		data = malloc(capacity);
+		if (data != NULL && buf->pos > 0) {
+			memcpy(data, buf->data, buf->pos);
 		}
 	}
+	if (data == NULL) {
+		error("cannot allocate %lu bytes to serialize an R object", (unsigned long) capacity);
+	}
 
-	UNPROTECT(2);
+	buf->data = data;
+	buf->size = capacity;
+	buf->owned = true;
+}
 
-	return result;
+static void plc_r_serial_write_char(R_outpstream_t stream, int c) {
+	plcRSerialBuffer *buf = (plcRSerialBuffer *) stream->data;
+
+	plc_r_serial_reserve(buf, 1);
+	buf->data[buf->pos++] = (char) c;
+}
+
+static void plc_r_serial_write_bytes(R_outpstream_t stream, void *data, int len) {
+	plcRSerialBuffer *buf = (plcRSerialBuffer *) stream->data;
+
+	plc_r_serial_reserve(buf, len);
+	memcpy(buf->data + buf->pos, data, len);
+	buf->pos += len;
+}
+
+static int plc_r_serial_read_char(R_inpstream_t stream) {
+	plcRSerialBuffer *buf = (plcRSerialBuffer *) stream->data;
+
+	if (buf->pos >= buf->size) {
+		error("bytea value is not a complete serialized R object");
+	}
+	return (unsigned char) buf->data[buf->pos++];
+}
+
+static void plc_r_serial_read_bytes(R_inpstream_t stream, void *data, int len) {
+	plcRSerialBuffer *buf = (plcRSerialBuffer *) stream->data;
+
+	if (buf->pos + len > buf->size) {
+		error("bytea value is not a complete serialized R object");
+	}
+	memcpy(data, buf->data + buf->pos, len);
+	buf->pos += len;
+}
+
+/* run under R_ToplevelExec, R errors must not unwind past the converter */
+static void plc_r_serialize(void *arg) {
+	plcRSerialCall *call = (plcRSerialCall *) arg;
+	struct R_outpstream_st out;
+
+	R_InitOutPStream(&out, (R_pstream_data_t) call->buf, R_pstream_xdr_format, 0,
+	                 plc_r_serial_write_char, plc_r_serial_write_bytes, NULL, R_NilValue);
+	R_Serialize(call->obj, &out);
+}
+
+static void plc_r_unserialize(void *arg) {
+	plcRSerialCall *call = (plcRSerialCall *) arg;
+	struct R_inpstream_st in;
+
+	R_InitInPStream(&in, (R_pstream_data_t) call->buf, R_pstream_any_format,
+	                plc_r_serial_read_char, plc_r_serial_read_bytes, NULL, R_NilValue);
+	call->obj = R_Unserialize(&in);
+}
+
+static void plc_r_serial_error(const char *func) {
+	if (last_R_error_msg) {
+		raise_execution_error("R interpreter expression evaluation error: %s", last_R_error_msg);
+	} else {
+		raise_execution_error("R interpreter expression evaluation error: "
+		                      "R expression evaluation error caught in \"%s\".", func);
+	}
+}
+
+static SEXP plc_r_object_from_bytea(char *input, plcRType *type UNUSED) {
+	plcRSerialBuffer buf;
+	plcRSerialCall call;
+
+	buf.data = plc_r_shm_resolve(input, &buf.size);
+	buf.pos = 0;
+	buf.owned = false;
+	call.obj = R_NilValue;
+	call.buf = &buf;
+
+	if (!R_ToplevelExec(plc_r_unserialize, &call)) {
+		plc_r_serial_error("unserialize");
+	}
+
+	PROTECT(call.obj);
+	return call.obj;
+}
+
+/* rawbytea function option: the bytes of a raw vector, no serialization */
+static SEXP plc_r_object_from_bytea_raw(char *input, plcRType *type UNUSED) {
+	SEXP obj;
+	char *data;
+	size_t bsize;
+
+	data = plc_r_shm_resolve(input, &bsize);
+	PROTECT(obj = allocVector(RAWSXP, (R_xlen_t) bsize));
+	memcpy((char *) RAW(obj), data, bsize);
+
+	return obj;
 }
 
 static int plc_r_object_as_int1(SEXP input, char **output, plcRType *type UNUSED) {
 	int res = 0;
-	char *out = (char *) malloc(1);
+	char *out = plc_r_value_alloc(1);
 	*output = out;
 	switch (TYPEOF(input)) {
 		case LGLSXP:
@@ -358,7 +649,7 @@ static int plc_r_object_as_int1(SEXP input, char **output, plcRType *type UNUSED
 
 static int plc_r_object_as_int2(SEXP input, char **output, plcRType *type UNUSED) {
 	int res = 0;
-	char *out = (char *) malloc(2);
+	char *out = plc_r_value_alloc(2);
 	*output = out;
 
 	switch (TYPEOF(input)) {
@@ -380,7 +671,7 @@ static int plc_r_object_as_int2(SEXP input, char **output, plcRType *type UNUSED
 
 static int plc_r_object_as_int4(SEXP input, char **output, plcRType *type UNUSED) {
 	int res = 0;
-	char *out = (char *) malloc(4);
+	char *out = plc_r_value_alloc(4);
 	*output = out;
 
 	switch (TYPEOF(input)) {
@@ -402,7 +693,7 @@ static int plc_r_object_as_int4(SEXP input, char **output, plcRType *type UNUSED
 
 static int plc_r_object_as_int8(SEXP input, char **output, plcRType *type UNUSED) {
 	int res = 0;
-	char *out = (char *) malloc(8);
+	char *out = plc_r_value_alloc(8);
 	*output = out;
 
 	switch (TYPEOF(input)) {
@@ -423,7 +714,7 @@ static int plc_r_object_as_int8(SEXP input, char **output, plcRType *type UNUSED
 
 static int plc_r_object_as_float4(SEXP input, char **output, plcRType *type UNUSED) {
 	int res = 0;
-	char *out = (char *) malloc(4);
+	char *out = plc_r_value_alloc(4);
 	*output = out;
 
 	switch (TYPEOF(input)) {
@@ -445,7 +736,7 @@ static int plc_r_object_as_float4(SEXP input, char **output, plcRType *type UNUS
 
 static int plc_r_object_as_float8(SEXP input, char **output, plcRType *type UNUSED) {
 	int res = 0;
-	char *out = (char *) malloc(8);
+	char *out = plc_r_value_alloc(8);
 	*output = out;
 
 	switch (TYPEOF(input)) {
@@ -467,7 +758,7 @@ static int plc_r_object_as_float8(SEXP input, char **output, plcRType *type UNUS
 static int plc_r_object_as_text(SEXP input, char **output, plcRType *type UNUSED) {
 	int res = 0;
 
-	*output = strdup(CHAR(asChar(input)));
+	*output = plc_r_value_text(asChar(input));
 	return res;
 }
 
@@ -485,13 +776,26 @@ static void plc_r_object_iter_free(plcIterator *iter) {
 	return;
 }
 
-rawdata *plc_r_vector_element_rawdata(SEXP vector, int idx, plcRType *rtype) {
-	rawdata *res = (rawdata *) pmalloc(sizeof(rawdata));
+/* iterators allocated in the arena are released with it */
+static void plc_r_object_iter_noop(plcIterator *iter UNUSED) {
+	return;
+}
+
+/*
+ * Convert element idx of vector into res, the value is allocated with
+ * plc_r_conv_alloc. Returns -1 if the R type does not match the expected one.
+ */
+int plc_r_vector_element(SEXP vector, int idx, plcRType *rtype, rawdata *res) {
+	/*
+	 * a whole vector returned as an array is null if it starts with NA,
+	 * the scalar types below check the NA of element idx themselves
+	 */
 	if ((vector == R_NilValue)
-	    || ((TYPEOF(vector) == LGLSXP) && (asLogical(vector) == NA_LOGICAL))
-	    || ((TYPEOF(vector) == INTSXP) && (asInteger(vector) == NA_INTEGER))
-	    || ((TYPEOF(vector) == REALSXP) && (asInteger(vector) == NA_REAL))
-	    || ((TYPEOF(vector) == STRSXP) && (vector == NA_STRING))) {
+	    || ((rtype->type == PLC_DATA_ARRAY)
+	        && (((TYPEOF(vector) == LGLSXP) && (asLogical(vector) == NA_LOGICAL))
+	            || ((TYPEOF(vector) == INTSXP) && (asInteger(vector) == NA_INTEGER))
+	            || ((TYPEOF(vector) == REALSXP) && (asInteger(vector) == NA_REAL))
+	            || ((TYPEOF(vector) == STRSXP) && (vector == NA_STRING))))) {
 
 		res->isnull = 1;
 		res->value = NULL;
@@ -502,11 +806,9 @@ rawdata *plc_r_vector_element_rawdata(SEXP vector, int idx, plcRType *rtype) {
 				if (!IS_LOGICAL(vector)) {
 					raise_execution_error("Actual R type is not matching excpected returned type %s [%d]",
 					                      plc_get_type_name(rtype->type), rtype->type);
-					pfree(res);
-					res = NULL;
-					break;
+					return -1;
 				}
-				res->value = pmalloc(sizeof(int));
+				res->value = plc_r_value_alloc(sizeof(int));
 				if (LOGICAL_DATA(vector)[idx] == NA_LOGICAL) {
 					res->isnull = 1;
 					*((int *) res->value) = (int) 0;
@@ -519,12 +821,10 @@ rawdata *plc_r_vector_element_rawdata(SEXP vector, int idx, plcRType *rtype) {
 				if (!IS_INTEGER(vector)) {
 					raise_execution_error("Actual R type is not matching excpected returned type %s [%d]",
 					                      plc_get_type_name(rtype->type), rtype->type);
-					pfree(res);
-					res = NULL;
-					break;
+					return -1;
 				}
 				/* 2 and 4 byte integer pgsql datatype => use R INTEGER */
-				res->value = pmalloc(sizeof(int));
+				res->value = plc_r_value_alloc(sizeof(int));
 				if (INTEGER_DATA(vector)[idx] == NA_INTEGER) {
 					*((int *) res->value) = (int) 0;
 					res->isnull = 1;
@@ -540,7 +840,12 @@ rawdata *plc_r_vector_element_rawdata(SEXP vector, int idx, plcRType *rtype) {
 				 */
 
 			case PLC_DATA_INT8:
-				res->value = pmalloc(sizeof(int64));
+				if (!IS_INTEGER(vector) && !IS_NUMERIC(vector)) {
+					raise_execution_error("Actual R type is not matching excpected returned type %s [%d]",
+					                      plc_get_type_name(rtype->type), rtype->type);
+					return -1;
+				}
+				res->value = plc_r_value_alloc(sizeof(int64));
 				if (IS_INTEGER(vector)) {
 					if (INTEGER_DATA(vector)[idx] == NA_INTEGER) {
 						*((int64 *) res->value) = (int64) 0;
@@ -548,19 +853,13 @@ rawdata *plc_r_vector_element_rawdata(SEXP vector, int idx, plcRType *rtype) {
 					} else {
 						*((int64 *) res->value) = (int64) (INTEGER_DATA(vector)[idx]);
 					}
-				} else if (IS_NUMERIC(vector)) {
+				} else {
 					if (R_IsNA(NUMERIC_DATA(vector)[idx])) {
 						res->isnull = 1;
 						*((int64 *) res->value) = (int64) 0;
 					} else {
 						*((int64 *) res->value) = (int64) (NUMERIC_DATA(vector)[idx]);
 					}
-				} else {
-					raise_execution_error("Actual R type is not matching excpected returned type %s [%d]",
-					                      plc_get_type_name(rtype->type), rtype->type);
-					pfree(res);
-					res = NULL;
-					break;
 				}
 				break;
 
@@ -568,11 +867,9 @@ rawdata *plc_r_vector_element_rawdata(SEXP vector, int idx, plcRType *rtype) {
 				if (!IS_NUMERIC(vector)) {
 					raise_execution_error("Actual R type is not matching excpected returned type %s [%d]",
 					                      plc_get_type_name(rtype->type), rtype->type);
-					pfree(res);
-					res = NULL;
-					break;
+					return -1;
 				}
-				res->value = pmalloc(sizeof(float4));
+				res->value = plc_r_value_alloc(sizeof(float4));
 				if (R_IsNA(NUMERIC_DATA(vector)[idx])) {
 					res->isnull = 1;
 					*((float4 *) res->value) = (float4) 0;
@@ -584,11 +881,9 @@ rawdata *plc_r_vector_element_rawdata(SEXP vector, int idx, plcRType *rtype) {
 				if (!IS_NUMERIC(vector)) {
 					raise_execution_error("Actual R type is not matching excpected returned type %s [%d]",
 					                      plc_get_type_name(rtype->type), rtype->type);
-					pfree(res);
-					res = NULL;
-					break;
+					return -1;
 				}
-				res->value = pmalloc(sizeof(float8));
+				res->value = plc_r_value_alloc(sizeof(float8));
 				if (R_IsNA(NUMERIC_DATA(vector)[idx])) {
 					res->isnull = 1;
 					*((float8 *) res->value) = (float8) 0;
@@ -600,7 +895,7 @@ rawdata *plc_r_vector_element_rawdata(SEXP vector, int idx, plcRType *rtype) {
 			case PLC_DATA_UDT:
 				if (VECTOR_ELT(vector, idx) == R_NilValue) {
 					res->isnull = TRUE;
-					res->value = pmalloc(sizeof(int));
+					res->value = plc_r_conv_alloc(sizeof(int));
 					*((int *) res->value) = (int) 0;
 				} else {
 					res->isnull = FALSE;
@@ -615,7 +910,7 @@ rawdata *plc_r_vector_element_rawdata(SEXP vector, int idx, plcRType *rtype) {
 					// these are arrays of primitives
 					if (VECTOR_ELT(vector, idx) == R_NilValue) {
 						res->isnull = TRUE;
-						res->value = pmalloc(sizeof(int));
+						res->value = plc_r_conv_alloc(sizeof(int));
 						*((int *) res->value) = (int) 0;
 					} else {
 						res->isnull = FALSE;
@@ -624,7 +919,7 @@ rawdata *plc_r_vector_element_rawdata(SEXP vector, int idx, plcRType *rtype) {
 				} else {
 					if (vector == R_NilValue) {
 						res->isnull = TRUE;
-						res->value = pmalloc(sizeof(int));
+						res->value = plc_r_conv_alloc(sizeof(int));
 						*((int *) res->value) = (int) 0;
 					} else {
 						res->isnull = FALSE;
@@ -648,11 +943,23 @@ rawdata *plc_r_vector_element_rawdata(SEXP vector, int idx, plcRType *rtype) {
 					res->value = NULL;
 				} else {
 					res->isnull = FALSE;
-					res->value = pstrdup((char *) CHAR(STRING_ELT(vector, idx)));
+					res->value = plc_r_value_text(STRING_ELT(vector, idx));
 				}
 		}
 
 	}
+	return 0;
+}
+
+rawdata *plc_r_vector_element_rawdata(SEXP vector, int idx, plcRType *rtype) {
+	rawdata *res = (rawdata *) plc_r_conv_alloc(sizeof(rawdata));
+
+	if (plc_r_vector_element(vector, idx, rtype, res) != 0) {
+		if (!plc_r_arena_active()) {
+			pfree(res);
+		}
+		return NULL;
+	}
 	return res;
 }
 
@@ -663,6 +970,7 @@ static rawdata *plc_r_object_as_array_next(plcIterator *iter) {
 	SEXP mtx;
 	int ptr;
 	int idx;
+	int state;
 
 	meta = (plcRArrMeta *) iter->payload;
 	ptrs = (plcRArrPointer *) iter->position;
@@ -671,12 +979,213 @@ static rawdata *plc_r_object_as_array_next(plcIterator *iter) {
 	idx = ptrs[ptr].pos;
 	mtx = ptrs[ptr].obj;
 
+	/* elements are handed over to the channel, they cannot live in the arena */
+	state = plc_r_arena_suspend();
 	res = plc_r_vector_element_rawdata(mtx, idx, meta->type);
+	plc_r_arena_resume(state);
 	ptrs[ptr].pos += 1;
 
 	return res;
 }
 
+/*
+ * Elements of logical, integer and double vectors of a fixed-width type,
+ * encoded straight from the vector data without the per-element dispatch
+ * of plc_r_vector_element
+ */
+static rawdata *plc_r_object_as_array_next_fixed(plcIterator *iter) {
+	plcRArrMeta *meta;
+	plcRArrPointer *ptrs;
+	rawdata *res;
+	size_t idx;
+	int ptr;
+
+	meta = (plcRArrMeta *) iter->payload;
+	ptrs = (plcRArrPointer *) iter->position;
+
+	ptr = meta->ndims - 1;
+	idx = ptrs[ptr].pos;
+	ptrs[ptr].pos += 1;
+
+	/* elements are handed over to the channel, which frees each of them */
+	res = (rawdata *) pmalloc(sizeof(rawdata));
+	res->value = pmalloc(meta->vallen);
+	bytes_encoded += meta->vallen;
+	plc_r_encode_fixed(ptrs[ptr].obj, idx, 1, meta->type->type, res->value, &res->isnull);
+
+	return res;
+}
+
+/* Threads used by the encoding loops of large vectors, see plc_r_set_encode_threads */
+static int encode_threads = 1;
+
+#define ENCODE_PARALLEL(n) (encode_threads > 1 && (n) >= PLC_R_PARALLEL_MIN_ELEMENTS)
+
+void plc_r_set_encode_threads(int nthreads) {
+	encode_threads = (nthreads > 0) ? nthreads : 1;
+}
+
+/*
+ * Width of the encoded elements of a logical, integer or double vector
+ * converted to a fixed-width type, 0 if it has to go element by element
+ */
+static size_t plc_r_fixed_length(SEXP input, plcDatatype type) {
+	switch (type) {
+		case PLC_DATA_INT1:
+			return IS_LOGICAL(input) ? sizeof(int) : 0;
+		case PLC_DATA_INT2:
+		case PLC_DATA_INT4:
+			return IS_INTEGER(input) ? sizeof(int) : 0;
+		case PLC_DATA_INT8:
+			return (IS_INTEGER(input) || IS_NUMERIC(input)) ? sizeof(int64) : 0;
+		case PLC_DATA_FLOAT4:
+			return IS_NUMERIC(input) ? sizeof(float4) : 0;
+		case PLC_DATA_FLOAT8:
+			return IS_NUMERIC(input) ? sizeof(float8) : 0;
+		default:
+			return 0;
+	}
+}
+
+/*
+ * Encode elements first .. first + count - 1 into values and the null map.
+ * The loops do not call into R nor allocate, so large vectors are split
+ * among encode_threads threads.
+ */
+static void plc_r_encode_fixed(SEXP input, size_t first, size_t count, plcDatatype type,
+                               char *values, char *nulls) {
+	long n = (long) count;
+	long i;
+
+	if (IS_LOGICAL(input) || IS_INTEGER(input)) {
+		/* LGLSXP and INTSXP share the int representation */
+		const int *src = (IS_LOGICAL(input) ? LOGICAL_DATA(input) : INTEGER_DATA(input)) + first;
+		int na = IS_LOGICAL(input) ? NA_LOGICAL : NA_INTEGER;
+
+		if (type == PLC_DATA_INT8) {
+			int64 *dst = (int64 *) values;
+
+			#pragma omp parallel for if (ENCODE_PARALLEL(n)) num_threads(encode_threads) schedule(static)
+			for (i = 0; i < n; i++) {
+				nulls[i] = (src[i] == na);
+				dst[i] = nulls[i] ? 0 : (int64) src[i];
+			}
+		} else {
+			int *dst = (int *) values;
+
+			#pragma omp parallel for if (ENCODE_PARALLEL(n)) num_threads(encode_threads) schedule(static)
+			for (i = 0; i < n; i++) {
+				nulls[i] = (src[i] == na);
+				dst[i] = nulls[i] ? 0 : src[i];
+			}
+		}
+	} else {
+		const double *src = NUMERIC_DATA(input) + first;
+
+		switch (type) {
+			case PLC_DATA_INT8:
+				#pragma omp parallel for if (ENCODE_PARALLEL(n)) num_threads(encode_threads) schedule(static)
+				for (i = 0; i < n; i++) {
+					nulls[i] = R_IsNA(src[i]);
+					((int64 *) values)[i] = nulls[i] ? 0 : (int64) src[i];
+				}
+				break;
+			case PLC_DATA_FLOAT4:
+				#pragma omp parallel for if (ENCODE_PARALLEL(n)) num_threads(encode_threads) schedule(static)
+				for (i = 0; i < n; i++) {
+					nulls[i] = R_IsNA(src[i]);
+					((float4 *) values)[i] = nulls[i] ? 0 : (float4) src[i];
+				}
+				break;
+			default:
+				#pragma omp parallel for if (ENCODE_PARALLEL(n)) num_threads(encode_threads) schedule(static)
+				for (i = 0; i < n; i++) {
+					nulls[i] = R_IsNA(src[i]);
+					((float8 *) values)[i] = nulls[i] ? 0 : src[i];
+				}
+				break;
+		}
+	}
+}
+
+/*
+ * Strings are resolved to their CHARSXP bytes first, then the bytes are
+ * copied into one buffer, in parallel for large vectors
+ */
+static int plc_r_encode_text_cells(SEXP vector, size_t first, size_t count, rawdata *cells, size_t stride) {
+	const char **src = (const char **) plc_r_conv_alloc(count * sizeof(char *));
+	size_t *offsets = (size_t *) plc_r_conv_alloc(count * sizeof(size_t));
+	size_t total = 0;
+	char *buffer;
+	long n = (long) count;
+	long i;
+
+	for (i = 0; i < n; i++) {
+		SEXP elem = STRING_ELT(vector, first + i);
+
+		offsets[i] = total;
+		if (elem == NA_STRING) {
+			src[i] = NULL;
+		} else {
+			src[i] = CHAR(elem);
+			total += LENGTH(elem) + 1;
+		}
+	}
+
+	buffer = (char *) plc_r_conv_alloc(total == 0 ? 1 : total);
+	bytes_encoded += total;
+
+	#pragma omp parallel for if (ENCODE_PARALLEL(n)) num_threads(encode_threads) schedule(static)
+	for (i = 0; i < n; i++) {
+		rawdata *cell = &cells[i * stride];
+
+		if (src[i] == NULL) {
+			cell->isnull = TRUE;
+			cell->value = NULL;
+		} else {
+			size_t len = ((i + 1 < n) ? offsets[i + 1] : total) - offsets[i];
+
+			cell->isnull = FALSE;
+			cell->value = buffer + offsets[i];
+			memcpy(cell->value, src[i], len);
+		}
+	}
+
+	return 1;
+}
+
+int plc_r_vector_encode_cells(SEXP vector, size_t first, size_t count, plcRType *type,
+                              rawdata *cells, size_t stride) {
+	size_t vallen;
+	char *values, *nulls;
+	long n = (long) count;
+	long i;
+
+	if (vector == R_NilValue || count == 0) {
+		return 0;
+	}
+	if (type->type == PLC_DATA_TEXT) {
+		return IS_CHARACTER(vector) ? plc_r_encode_text_cells(vector, first, count, cells, stride) : 0;
+	}
+
+	vallen = plc_r_fixed_length(vector, type->type);
+	if (vallen == 0) {
+		return 0;
+	}
+
+	values = plc_r_value_alloc(count * vallen);
+	nulls = (char *) plc_r_conv_alloc(count);
+	plc_r_encode_fixed(vector, first, count, type->type, values, nulls);
+
+	#pragma omp parallel for if (ENCODE_PARALLEL(n)) num_threads(encode_threads) schedule(static)
+	for (i = 0; i < n; i++) {
+		cells[i * stride].isnull = nulls[i];
+		cells[i * stride].value = values + i * vallen;
+	}
+
+	return 1;
+}
+
 int plc_r_matrix_as_setof(SEXP input, int start, int dim1, char **output, plcRType *type) {
 
 	plcRArrMeta *meta;
@@ -708,20 +1217,21 @@ int plc_r_matrix_as_setof(SEXP input, int start, int dim1, char **output, plcRTy
 
 
 		/* Allocate the iterator */
-		iter = (plcIterator *) pmalloc(sizeof(plcIterator));
+		iter = (plcIterator *) plc_r_conv_alloc(sizeof(plcIterator));
 
 		/* Initialize metas */
-		arrmeta = (plcArrayMeta *) pmalloc(sizeof(plcArrayMeta));
+		arrmeta = (plcArrayMeta *) plc_r_conv_alloc(sizeof(plcArrayMeta));
 		arrmeta->ndims = ndims;
-		arrmeta->dims = (int *) pmalloc(ndims * sizeof(int));
+		arrmeta->dims = (int *) plc_r_conv_alloc(ndims * sizeof(int));
 		arrmeta->size = (ndims == 0) ? 0 : 1;
 		arrmeta->type = type->subTypes[0].type;
 
-		meta = (plcRArrMeta *) pmalloc(sizeof(plcRArrMeta));
+		meta = (plcRArrMeta *) plc_r_conv_alloc(sizeof(plcRArrMeta));
 		meta->ndims = ndims;
-		meta->dims = (size_t *) pmalloc(ndims * sizeof(size_t));
-		meta->outputfunc = plc_get_output_function(type->subTypes[0].type);
+		meta->dims = (size_t *) plc_r_conv_alloc(ndims * sizeof(size_t));
+		meta->outputfunc = type->subTypes[0].conv.outputfunc;
 		meta->type = &type->subTypes[0];
+		meta->vallen = 0;
 
 		for (i = 0; i < ndims; i++) {
 			meta->dims[i] = dims[i];
@@ -733,7 +1243,7 @@ int plc_r_matrix_as_setof(SEXP input, int start, int dim1, char **output, plcRTy
 		iter->payload = (char *) meta;
 
 		/* Initializing initial position */
-		ptrs = (plcRArrPointer *) pmalloc(ndims * sizeof(plcRArrPointer));
+		ptrs = (plcRArrPointer *) plc_r_conv_alloc(ndims * sizeof(plcRArrPointer));
 		for (i = 0; i < ndims; i++) {
 			ptrs[i].pos = start;
 			/* TODO this only works for one dimensional arrays */
@@ -747,7 +1257,7 @@ int plc_r_matrix_as_setof(SEXP input, int start, int dim1, char **output, plcRTy
 
 		/* Initializing "next" and "cleanup" functions */
 		iter->next = plc_r_object_as_array_next;
-		iter->cleanup = plc_r_object_iter_free;
+		iter->cleanup = plc_r_arena_active() ? plc_r_object_iter_noop : plc_r_object_iter_free;
 
 		*output = (char *) iter;
 
@@ -788,20 +1298,22 @@ static int plc_r_object_as_array(SEXP input, char **output, plcRType *type) {
 
 
 		/* Allocate the iterator */
-		iter = (plcIterator *) pmalloc(sizeof(plcIterator));
+		iter = (plcIterator *) plc_r_conv_alloc(sizeof(plcIterator));
 
 		/* Initialize metas */
-		arrmeta = (plcArrayMeta *) pmalloc(sizeof(plcArrayMeta));
+		arrmeta = (plcArrayMeta *) plc_r_conv_alloc(sizeof(plcArrayMeta));
 		arrmeta->ndims = ndims;
-		arrmeta->dims = (int *) pmalloc(ndims * sizeof(int));
+		arrmeta->dims = (int *) plc_r_conv_alloc(ndims * sizeof(int));
 		arrmeta->size = (ndims == 0) ? 0 : 1;
 		arrmeta->type = type->subTypes[0].type;
 
-		meta = (plcRArrMeta *) pmalloc(sizeof(plcRArrMeta));
+		meta = (plcRArrMeta *) plc_r_conv_alloc(sizeof(plcRArrMeta));
 		meta->ndims = ndims;
-		meta->dims = (size_t *) pmalloc(ndims * sizeof(size_t));
-		meta->outputfunc = plc_get_output_function(type->subTypes[0].type);
+		meta->dims = (size_t *) plc_r_conv_alloc(ndims * sizeof(size_t));
+		meta->outputfunc = type->subTypes[0].conv.outputfunc;
 		meta->type = &type->subTypes[0];
+		/* fixed-width elements of numeric vectors skip plc_r_vector_element */
+		meta->vallen = plc_r_fixed_length(input, meta->type->type);
 
 		for (i = 0; i < ndims; i++) {
 			meta->dims[i] = dims[i];
@@ -813,7 +1325,7 @@ static int plc_r_object_as_array(SEXP input, char **output, plcRType *type) {
 		iter->payload = (char *) meta;
 
 		/* Initializing initial position */
-		ptrs = (plcRArrPointer *) pmalloc(ndims * sizeof(plcRArrPointer));
+		ptrs = (plcRArrPointer *) plc_r_conv_alloc(ndims * sizeof(plcRArrPointer));
 		for (i = 0; i < ndims; i++) {
 			ptrs[i].pos = 0;
 			/* TODO this only works for one dimensional arrays */
@@ -826,8 +1338,12 @@ static int plc_r_object_as_array(SEXP input, char **output, plcRType *type) {
 		iter->data = (char *) input;
 
 		/* Initializing "next" and "cleanup" functions */
-		iter->next = plc_r_object_as_array_next;
-		iter->cleanup = plc_r_object_iter_free;
+		if (meta->vallen > 0) {
+			iter->next = plc_r_object_as_array_next_fixed;
+		} else {
+			iter->next = plc_r_object_as_array_next;
+		}
+		iter->cleanup = plc_r_arena_active() ? plc_r_object_iter_noop : plc_r_object_iter_free;
 
 		*output = (char *) iter;
 	} else {
@@ -850,8 +1366,8 @@ static int plc_r_object_as_udt(SEXP input, char **output, plcRType *type) {
 		int i = 0;
 		plcUDT *udt;
 
-		udt = pmalloc(sizeof(plcUDT));
-		udt->data = pmalloc(type->nSubTypes * sizeof(rawdata));
+		udt = plc_r_conv_alloc(sizeof(plcUDT));
+		udt->data = plc_r_conv_alloc(type->nSubTypes * sizeof(rawdata));
 		for (i = 0; i < type->nSubTypes && res == 0; i++) {
 
 			PROTECT(dfcol = VECTOR_ELT(input, i));
@@ -866,10 +1382,7 @@ static int plc_r_object_as_udt(SEXP input, char **output, plcRType *type) {
 				if (INTEGER(dfcol)[i] != NA_INTEGER) {
 					SEXP c = Rf_asCharacterFactor(dfcol);
 
-					rawdata *datum = plc_r_vector_element_rawdata(c, 0, &type->subTypes[i]);
-					udt->data[i].isnull = datum->isnull;
-					udt->data[i].value = datum->value;
-					free(datum);
+					plc_r_vector_element(c, 0, &type->subTypes[i], &udt->data[i]);
 
 				} else {
 					udt->data[i].isnull = TRUE;
@@ -877,10 +1390,7 @@ static int plc_r_object_as_udt(SEXP input, char **output, plcRType *type) {
 				}
 
 			} else {
-				rawdata *datum = plc_r_vector_element_rawdata(dfcol, 0, &type->subTypes[i]);
-				udt->data[i].isnull = datum->isnull;
-				udt->data[i].value = datum->value;
-				free(datum);
+				plc_r_vector_element(dfcol, 0, &type->subTypes[i], &udt->data[i]);
 			}
 			UNPROTECT(1);
 		}
@@ -890,42 +1400,81 @@ static int plc_r_object_as_udt(SEXP input, char **output, plcRType *type) {
 	return res;
 }
 
+SEXP plc_r_bytea_to_r(char *input, bool unserialize) {
+	if (unserialize) {
+		return plc_r_object_from_bytea(input, NULL);
+	}
+	return plc_r_object_from_bytea_raw(input, NULL);
+}
+
 static int plc_r_object_as_bytea(SEXP input, char **output, plcRType *type UNUSED) {
-	SEXP obj;
-	SEXP s, t;
-	int len, status;
-	char *result;
+	plcRSerialBuffer buf;
+	plcRSerialCall call;
+	char *payload;
+	char *shm;
+	int res = 0;
 
-	/*
-	 * Need to construct a call to
-	 * serialize(rval, NULL)
-	 */
-	PROTECT(t = s = allocList(3));
-	SET_TYPEOF(s, LANGSXP);
-	SETCAR(t, install("serialize"));
-	t = CDR(t);
-	SETCAR(t, input);
-	t = CDR(t);
-	SETCAR(t, R_NilValue);
-
-	PROTECT(obj = R_tryEval(s, R_GlobalEnv, &status));
-	if (status != 0) {
-		if (last_R_error_msg) {
-			raise_execution_error("R interpreter expression evaluation error: %s", last_R_error_msg);
-		} else {
-			raise_execution_error("R interpreter expression evaluation error: "
-				                      "R expression evaluation error caught in \"serialize\".");
+	/* serialize once, straight into the free shared memory while it fits */
+	buf.data = plc_r_shm_free_space(&buf.size);
+	buf.pos = 0;
+	buf.owned = false;
+	call.obj = input;
+	call.buf = &buf;
+
+	if (!R_ToplevelExec(plc_r_serialize, &call)) {
+		if (buf.owned) {
+			free(buf.data);
 		}
+		plc_r_serial_error("serialize");
 		return -1;
 	}
 
-	len = LENGTH(obj);
-	result = pmalloc(len + 4);
-	*((int *) result) = len;
-	memcpy(result + 4, (char *) RAW(obj), len);
-	*output = result;
+	/* a value left in the free shared memory is already in place */
+	bytes_encoded += buf.pos;
+	shm = plc_r_shm_alloc(buf.pos);
+	if (shm != NULL) {
+		if (shm != buf.data) {
+			memcpy(shm, buf.data, buf.pos);
+		}
+		*output = plc_r_shm_descriptor(shm, buf.pos);
+	} else if ((*output = plc_r_shm_inline(buf.pos, &payload)) == NULL) {
+		raise_execution_error("Serialized R object of %zu bytes is too large for bytea", buf.pos);
+		res = -1;
+	} else {
+		memcpy(payload, buf.data, buf.pos);
+	}
+
+	if (buf.owned) {
+		free(buf.data);
+	}
+	return res;
+}
 
-	UNPROTECT(2);
+static int plc_r_object_as_bytea_raw(SEXP input, char **output, plcRType *type UNUSED) {
+	char *payload;
+	char *shm;
+	R_xlen_t len;
+
+	if (TYPEOF(input) != RAWSXP) {
+		raise_execution_error("Function option rawbytea requires a raw vector for bytea, got %s",
+		                      type2char(TYPEOF(input)));
+		return -1;
+	}
+
+	len = XLENGTH(input);
+	bytes_encoded += (size_t) len;
+	shm = plc_r_shm_alloc((size_t) len);
+	if (shm != NULL) {
+		memcpy(shm, (char *) RAW(input), len);
+		*output = plc_r_shm_descriptor(shm, (size_t) len);
+		return 0;
+	}
+	*output = plc_r_shm_inline((size_t) len, &payload);
+	if (*output == NULL) {
+		raise_execution_error("Raw vector of %ld bytes is too large for bytea", (long) len);
+		return -1;
+	}
+	memcpy(payload, (char *) RAW(input), len);
 
 	return 0;
 }
@@ -1043,22 +1592,162 @@ static void plc_parse_type(plcRType *Rtype, plcType *type, char *argName, bool i
 	}
 }
 
+/*
+ * Options are given in comment lines of the function body, i.e.
+ *   # plcontainer: nocompile batch
+ */
+static int plc_r_parse_options(const char *src) {
+	const char *prefix = "# plcontainer:";
+	const char *line = src;
+	int flags = 0;
+
+	while (line != NULL && *line != '\0') {
+		const char *end = strchr(line, '\n');
+
+		while (*line == ' ' || *line == '\t') {
+			line++;
+		}
+
+		if (strncmp(line, prefix, strlen(prefix)) == 0) {
+			char *opts, *opt, *saveptr;
+
+			line += strlen(prefix);
+			opts = (end == NULL) ? strdup(line) : strndup(line, end - line);
+			for (opt = strtok_r(opts, " \t\r,", &saveptr); opt != NULL;
+			     opt = strtok_r(NULL, " \t\r,", &saveptr)) {
+				if (strcmp(opt, "nocompile") == 0) {
+					flags |= PLC_R_FUNC_NOCOMPILE;
+				} else if (strcmp(opt, "batch") == 0) {
+					flags |= PLC_R_FUNC_BATCH;
+				} else if (strcmp(opt, "columns") == 0) {
+					flags |= PLC_R_FUNC_COLUMNS;
+				} else if (strcmp(opt, "rawbytea") == 0) {
+					flags |= PLC_R_FUNC_RAWBYTEA;
+				} else {
+					plc_elog(WARNING, "Unknown R function option \"%s\" ignored", opt);
+				}
+			}
+			free(opts);
+		}
+
+		line = (end == NULL) ? NULL : end + 1;
+	}
+
+	return flags;
+}
+
+/* rawbytea option: bytea values are the bytes of raw vectors */
+static void plc_r_type_raw_bytea(plcRType *type) {
+	int i;
+
+	if (type->type == PLC_DATA_BYTEA) {
+		type->conv.inputfunc = plc_r_object_from_bytea_raw;
+		type->conv.outputfunc = plc_r_object_as_bytea_raw;
+	}
+	for (i = 0; i < type->nSubTypes; i++) {
+		plc_r_type_raw_bytea(&type->subTypes[i]);
+	}
+}
+
+static bool plc_r_type_matches(plcRType *rtype, plcType *type, char *argName) {
+	int i;
+
+	if (rtype->type != type->type || rtype->nSubTypes != type->nSubTypes) {
+		return false;
+	}
+	if ((rtype->typeName == NULL) != (type->typeName == NULL)
+	    || (rtype->typeName != NULL && strcmp(rtype->typeName, type->typeName) != 0)) {
+		return false;
+	}
+	if ((rtype->argName == NULL) != (argName == NULL)
+	    || (rtype->argName != NULL && strcmp(rtype->argName, argName) != 0)) {
+		return false;
+	}
+	for (i = 0; i < type->nSubTypes; i++) {
+		if (!plc_r_type_matches(&rtype->subTypes[i], &type->subTypes[i], NULL)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool plc_r_plan_matches(plcRPlan *plan, uint32 hash, int flags, plcMsgCallreq *call) {
+	int i;
+
+	if (plan->hash != hash || plan->flags != flags || plan->nargs != call->nargs) {
+		return false;
+	}
+	for (i = 0; i < call->nargs; i++) {
+		if (!plc_r_type_matches(&plan->args[i], &call->args[i].type, call->args[i].name)) {
+			return false;
+		}
+	}
+	return plc_r_type_matches(&plan->res, &call->retType, "results");
+}
+
+/* Conversion plans in use, looked up by signature hash */
+static plcRPlan *plans = NULL;
+
+static plcRPlan *plc_r_get_plan(plcMsgCallreq *call, int flags) {
+	uint32 hash = plc_r_signature_hash(call);
+	plcRPlan *plan;
+	int i;
+
+	for (plan = plans; plan != NULL; plan = plan->next) {
+		if (plc_r_plan_matches(plan, hash, flags, call)) {
+			plan->refcount += 1;
+			return plan;
+		}
+	}
+
+	plan = (plcRPlan *) malloc(sizeof(plcRPlan));
+	plan->hash = hash;
+	plan->refcount = 1;
+	plan->flags = flags;
+	plan->nargs = call->nargs;
+	plan->nnamed = 0;
+	plan->args = (plcRType *) malloc(plan->nargs * sizeof(plcRType));
+
+	for (i = 0; i < plan->nargs; i++) {
+		plc_parse_type(&plan->args[i], &call->args[i].type, call->args[i].name, false);
+		if (call->args[i].name != NULL) {
+			plan->nnamed += 1;
+		}
+	}
+
+	plc_parse_type(&plan->res, &call->retType, "results", false);
+
+	if (flags & PLC_R_FUNC_RAWBYTEA) {
+		for (i = 0; i < plan->nargs; i++)
+			plc_r_type_raw_bytea(&plan->args[i]);
+		plc_r_type_raw_bytea(&plan->res);
+	}
+
+	plan->next = plans;
+	plans = plan;
+
+	return plan;
+}
+
 plcRFunction *plc_R_init_function(plcMsgCallreq *call) {
 	plcRFunction *res;
-	int i;
 
 	res = (plcRFunction *) malloc(sizeof(plcRFunction));
 	res->call = call;
+	res->RProc = R_NilValue;
+	res->objectid = (unsigned int) call->objectid;
+	res->hash = plc_r_function_hash(call);
+	res->refcount = 1;
+	res->flags = plc_r_parse_options(call->proc.src);
+	res->compile_ms = 0;
+	res->stats = NULL;
 	res->proc.src = strdup(call->proc.src);
 	res->proc.name = strdup(call->proc.name);
 	res->nargs = call->nargs;
 	res->retset = call->retset;
-	res->args = (plcRType *) malloc(res->nargs * sizeof(plcRType));
-
-	for (i = 0; i < res->nargs; i++)
-		plc_parse_type(&res->args[i], &call->args[i].type, call->args[i].name, false);
-
-	plc_parse_type(&res->res, &call->retType, "results", false);
+	res->plan = plc_r_get_plan(call, res->flags & PLC_R_PLAN_FLAGS);
+	res->args = res->plan->args;
+	res->res = &res->plan->res;
 
 	return res;
 }
@@ -1093,13 +1782,33 @@ static void plc_r_free_type(plcRType *type) {
 	return;
 }
 
+static void plc_r_release_plan(plcRPlan *plan) {
+	plcRPlan **prev;
+	int i;
+
+	plan->refcount -= 1;
+	if (plan->refcount > 0) {
+		return;
+	}
+
+	for (prev = &plans; *prev != NULL; prev = &(*prev)->next) {
+		if (*prev == plan) {
+			*prev = plan->next;
+			break;
+		}
+	}
+
+	for (i = 0; i < plan->nargs; i++)
+		plc_r_free_type(&plan->args[i]);
+	plc_r_free_type(&plan->res);
+
+	free(plan->args);
+	free(plan);
+}
+
 void plc_r_free_function(plcRFunction *func) {
-	int i = 0;
-	for (i = 0; i < func->nargs; i++)
-		plc_r_free_type(&func->args[i]);
-	plc_r_free_type(&func->res);
+	plc_r_release_plan(func->plan);
 
-	free(func->args);
 	free(func->proc.name);
 	free(func->proc.src);
 	free(func);
@@ -1113,10 +1822,10 @@ void plc_free_result_conversions(plcRResult *res) {
 void plc_r_copy_type(plcType *type, plcRType *rtype) {
 	type->type = rtype->type;
 	type->nSubTypes = rtype->nSubTypes;
-	type->typeName = (rtype->typeName == NULL) ? NULL : strdup(rtype->typeName);
+	type->typeName = (rtype->typeName == NULL) ? NULL : plc_r_conv_strdup(rtype->typeName);
 	if (type->nSubTypes > 0) {
 		int i = 0;
-		type->subTypes = (plcType *) pmalloc(type->nSubTypes * sizeof(plcType));
+		type->subTypes = (plcType *) plc_r_conv_alloc(type->nSubTypes * sizeof(plcType));
 		for (i = 0; i < type->nSubTypes; i++)
 			plc_r_copy_type(&type->subTypes[i], &rtype->subTypes[i]);
 	} else {
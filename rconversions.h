@@ -17,6 +17,9 @@
 
 #define PLC_MAX_ARRAY_DIMS 2
 
+/* Vectors shorter than this are encoded by one thread, see plc_r_set_encode_threads */
+#define PLC_R_PARALLEL_MIN_ELEMENTS 65536
+
 typedef struct plcRType plcRType;
 
 typedef SEXP (*plcRInputFunc)(char *, plcRType *);
@@ -33,6 +36,8 @@ typedef struct plcRArrMeta {
 	size_t *dims;
 	plcRType *type;
 	plcROutputFunc outputfunc;
+	/* width of the elements encoded by plc_r_object_as_array_next_fixed, 0 if not used */
+	size_t vallen;
 } plcRArrMeta;
 
 typedef struct plcRTypeConv {
@@ -54,6 +59,32 @@ struct plcRType {
 	plcRTypeConv conv;
 };
 
+/* Per function options set with a "# plcontainer:" comment in the source */
+#define PLC_R_FUNC_NOCOMPILE   0x01
+#define PLC_R_FUNC_BATCH       0x02
+#define PLC_R_FUNC_COLUMNS     0x04
+#define PLC_R_FUNC_RAWBYTEA    0x08
+
+/* Options that change the conversions, functions differing in them get their own plan */
+#define PLC_R_PLAN_FLAGS       PLC_R_FUNC_RAWBYTEA
+
+/*
+ * Conversion plan of a function signature: parsed argument and result types
+ * with their conversion functions resolved. A plan is immutable once built
+ * and shared by all functions having the same signature and conversion
+ * options.
+ */
+typedef struct plcRPlan {
+	uint32 hash;
+	int refcount;
+	int flags;
+	int nargs;
+	int nnamed;
+	plcRType *args;
+	plcRType res;
+	struct plcRPlan *next;
+} plcRPlan;
+
 typedef struct plcRFunction {
 	plcProcSrc proc;
 	plcMsgCallreq *call;
@@ -61,8 +92,14 @@ typedef struct plcRFunction {
 	int nargs;
 	int retset;
 	unsigned int objectid;
+	uint32 hash;
+	int refcount;
+	int flags;
+	double compile_ms; /* time of the byte-compilation, 0 if not compiled */
+	struct plcRFunctionStats *stats; /* see rstats.h, kept when evicted */
+	plcRPlan *plan;
 	plcRType *args;
-	plcRType res;
+	plcRType *res;
 } plcRFunction;
 
 plcRFunction *plc_R_init_function(plcMsgCallreq *call);
@@ -79,6 +116,31 @@ SEXP get_r_vector(plcDatatype type_id, int numels);
 
 rawdata *plc_r_vector_element_rawdata(SEXP vector, int idx, plcRType *type);
 
+int plc_r_vector_element(SEXP vector, int idx, plcRType *type, rawdata *res);
+
+/*
+ * Convert elements first .. first + count - 1 of a vector into cells[0],
+ * cells[stride], ... in one pass. Returns 0 if the vector has to be
+ * converted with plc_r_vector_element.
+ */
+int plc_r_vector_encode_cells(SEXP vector, size_t first, size_t count, plcRType *type,
+                              rawdata *cells, size_t stride);
+
+// Number of threads encoding large numeric and text vectors
+void plc_r_set_encode_threads(int nthreads);
+
+// Let large array arguments keep the buffers of the call request instead of a copy
+void plc_r_set_adopt_arrays(bool adopt);
+
+// A length-prefixed bytea value as a raw vector, or the R object it holds, returned protected
+SEXP plc_r_bytea_to_r(char *input, bool unserialize);
+
+// Total bytes of text values converted to R so far, used for the call statistics
+size_t plc_r_text_bytes_converted(void);
+
+// Total payload bytes of the values encoded for the backend so far, used for the call statistics
+size_t plc_r_bytes_encoded(void);
+
 int plc_r_matrix_as_setof(SEXP input, int start, int dim1, char **output, plcRType *type);
 
 plcROutputFunc plc_get_output_function(plcDatatype dt);
@@ -13,6 +13,17 @@
 #include "rcall.h"
 #include "rlogging.h"
 
+/*
+ * Messages are buffered as level followed by the zero terminated text and
+ * sent in order at the end of the call, when the buffer reaches this size,
+ * or right away for ERROR and FATAL
+ */
+#define LOG_BUFFER_FLUSH_SIZE (64 * 1024)
+
+static char *log_buffer = NULL;
+static size_t log_buffer_used = 0;
+static size_t log_buffer_size = 0;
+
 static SEXP plr_output(volatile int, SEXP args);
 
 SEXP plr_debug(SEXP args) {
@@ -43,26 +54,61 @@ SEXP plr_fatal(SEXP args) {
 	return plr_output(FATAL, args);
 }
 
-static SEXP plr_output(volatile int level, SEXP args) {
-	plcConn *conn = plcconn_global;
-	plcMsgLog *msg;
+static void log_buffer_append(int level, const char *str) {
+	size_t len = sizeof(int) + strlen(str) + 1;
 
-	if (plc_is_execution_terminated == 0) {
-		char *str_msg = strdup(CHAR(asChar(args)));
+	if (log_buffer_used + len > log_buffer_size) {
+		size_t size = (log_buffer_size == 0) ? 1024 : log_buffer_size;
 
+		while (size < log_buffer_used + len) {
+			size *= 2;
+		}
+		log_buffer = realloc(log_buffer, size);
+		log_buffer_size = size;
+	}
 
-		if (level >= ERROR)
-			plc_is_execution_terminated = 1;
+	memcpy(log_buffer + log_buffer_used, &level, sizeof(int));
+	memcpy(log_buffer + log_buffer_used + sizeof(int), str, len - sizeof(int));
+	log_buffer_used += len;
+}
+
+void plr_log_flush(void) {
+	plcMsgLog msg;
+	size_t pos = 0;
 
-		msg = pmalloc(sizeof(plcMsgLog));
-		msg->msgtype = MT_LOG;
-		msg->level = level;
-		msg->message = str_msg;
+	/* once the execution is terminated the backend does not expect them */
+	while (pos < log_buffer_used && plc_is_execution_terminated == 0) {
+		memcpy(&msg.level, log_buffer + pos, sizeof(int));
+		pos += sizeof(int);
 
-		plcontainer_channel_send(conn, (plcMessage *) msg);
+		msg.msgtype = MT_LOG;
+		msg.message = log_buffer + pos;
+		pos += strlen(msg.message) + 1;
+
+		plcontainer_channel_send(plcconn_global, (plcMessage *) &msg);
+	}
 
-		free(msg);
-		free(str_msg);
+	log_buffer_used = 0;
+}
+
+static SEXP plr_output(volatile int level, SEXP args) {
+	/*
+	 * debug messages under the backend log level would be discarded there,
+	 * drop them before converting the argument
+	 */
+	if (level < LOG && level < client_log_level) {
+		return R_NilValue;
+	}
+
+	if (plc_is_execution_terminated == 0) {
+		log_buffer_append(level, CHAR(asChar(args)));
+
+		if (level >= ERROR) {
+			plr_log_flush();
+			plc_is_execution_terminated = 1;
+		} else if (log_buffer_used >= LOG_BUFFER_FLUSH_SIZE) {
+			plr_log_flush();
+		}
 	}
 
 	/*
@@ -23,4 +23,7 @@ SEXP plr_error(SEXP args);
 
 SEXP plr_fatal(SEXP args);
 
+// Send the buffered log messages of the current call
+void plr_log_flush(void);
+
 #endif /* PLC_RLOGGING_H */
@@ -0,0 +1,211 @@
+/*------------------------------------------------------------------------------
+ *
+ * Copyright (c) 2016-Present Pivotal Software, Inc
+ *
+ *------------------------------------------------------------------------------
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "common/comm_channel.h"
+#include "common/comm_utils.h"
+#include "rcall.h"
+#include "rarena.h"
+#include "rshm.h"
+
+/* smallest value in bytes the client sends through the region */
+#define SHM_THRESHOLD_ENV     "RCLIENT_SHM_THRESHOLD"
+#define DEFAULT_SHM_THRESHOLD (1024 * 1024)
+
+#define SHM_OFFER_FORMAT "plcshm 1 %4095s %zu"
+#define SHM_REPLY_OK     "plcshm ok"
+#define SHM_REPLY_NO     "plcshm no"
+
+#define SHM_ALIGN 64
+
+static char *shm_base = NULL;
+static size_t shm_half = 0;
+static size_t shm_out_used = 0;
+static size_t shm_threshold = DEFAULT_SHM_THRESHOLD;
+
+/* Map the region named in the offer, false keeps the values inline */
+static bool shm_map_offer(plcMsgRaw *offer) {
+	char text[PATH_MAX + 64];
+	char path[PATH_MAX];
+	size_t size, len;
+	void *base;
+	int fd;
+
+	len = (offer->size > 0) ? (size_t) offer->size : 0;
+	if (len >= sizeof(text)) {
+		len = sizeof(text) - 1;
+	}
+	memcpy(text, offer->data, len);
+	text[len] = '\0';
+
+	if (sscanf(text, SHM_OFFER_FORMAT, path, &size) != 2 || size < 2) {
+		plc_elog(WARNING, "Malformed shared memory offer from the backend: %s", text);
+		return false;
+	}
+
+	fd = open(path, O_RDWR);
+	if (fd < 0) {
+		plc_elog(WARNING, "Cannot open shared memory file %s: %s", path, strerror(errno));
+		return false;
+	}
+	base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED) {
+		plc_elog(WARNING, "Cannot map shared memory file %s: %s", path, strerror(errno));
+		return false;
+	}
+
+	shm_base = (char *) base;
+	shm_half = size / 2;
+	shm_out_used = 0;
+	shm_threshold = (size_t) plc_r_getenv_int(SHM_THRESHOLD_ENV, DEFAULT_SHM_THRESHOLD);
+
+	plc_elog(LOG, "Shared memory channel of %zu bytes set up for values from %zu bytes",
+	         size, shm_threshold);
+	return true;
+}
+
+/*
+ * Only a backend that supports the side channel sends the offer, as a raw
+ * message "plcshm 1 <path> <size>" ahead of the first call. For any other
+ * backend the first message is a call request, it is served here and the
+ * values stay inline.
+ */
+int plc_r_shm_negotiate(plcConn *conn) {
+	plcMessage *msg;
+	plcMsgRaw reply;
+
+	for (;;) {
+		if (plcontainer_channel_receive(conn, &msg, MT_RAW_BIT | MT_CALLREQ_BIT | MT_PING_BIT) < 0) {
+			plc_elog(LOG, "Connection closed before the first call");
+			return -1;
+		}
+
+		switch (msg->msgtype) {
+			case MT_PING:
+				plcontainer_channel_send(conn, msg);
+				continue;
+			case MT_CALLREQ:
+				handle_call((plcMsgCallreq *) msg, conn);
+				free_callreq((plcMsgCallreq *) msg, false, false);
+				return 0;
+			default:
+				break;
+		}
+
+		reply.msgtype = MT_RAW;
+		reply.data = shm_map_offer((plcMsgRaw *) msg) ? SHM_REPLY_OK : SHM_REPLY_NO;
+		reply.size = strlen(reply.data) + 1;
+		free_rawmsg((plcMsgRaw *) msg);
+
+		if (plcontainer_channel_send(conn, (plcMessage *) &reply) < 0) {
+			plc_elog(WARNING, "Connection lost while setting up the shared memory channel");
+			return -1;
+		}
+		return 0;
+	}
+}
+
+void plc_r_shm_reset(void) {
+	shm_out_used = 0;
+}
+
+char *plc_r_shm_alloc(size_t len) {
+	size_t aligned = (len + SHM_ALIGN - 1) & ~((size_t) SHM_ALIGN - 1);
+	char *res;
+
+	if (shm_base == NULL || len < shm_threshold || aligned > shm_half - shm_out_used) {
+		return NULL;
+	}
+
+	res = shm_base + shm_half + shm_out_used;
+	shm_out_used += aligned;
+	return res;
+}
+
+char *plc_r_shm_free_space(size_t *len) {
+	if (shm_base == NULL || shm_out_used >= shm_half) {
+		*len = 0;
+		return NULL;
+	}
+
+	*len = shm_half - shm_out_used;
+	return shm_base + shm_half + shm_out_used;
+}
+
+/* offsets are relative to the half of the sender */
+char *plc_r_shm_descriptor(char *data, size_t len) {
+	char *res = (char *) plc_r_conv_alloc(4 + PLC_R_SHM_DESC_SIZE);
+	uint64_t offset = (uint64_t) (data - (shm_base + shm_half));
+	uint64_t length = (uint64_t) len;
+
+	*((int *) res) = PLC_R_SHM_DESC_SIZE;
+	res[4] = PLC_R_SHM_TAG_REGION;
+	memcpy(res + 5, &offset, sizeof(offset));
+	memcpy(res + 13, &length, sizeof(length));
+
+	return res;
+}
+
+char *plc_r_shm_inline(size_t len, char **payload) {
+	size_t header = (shm_base != NULL) ? 5 : 4;
+	char *res;
+
+	if (len > (size_t) INT_MAX - (header - 4)) {
+		return NULL;
+	}
+
+	res = (char *) plc_r_conv_alloc(header + len);
+	*((int *) res) = (int) (len + header - 4);
+	if (shm_base != NULL) {
+		res[4] = PLC_R_SHM_TAG_INLINE;
+	}
+	*payload = res + header;
+
+	return res;
+}
+
+char *plc_r_shm_resolve(char *input, size_t *len) {
+	int size = *((int *) input);
+	uint64_t offset, length;
+
+	if (shm_base == NULL) {
+		*len = (size_t) size;
+		return input + 4;
+	}
+
+	if (size >= 1 && input[4] == PLC_R_SHM_TAG_INLINE) {
+		*len = (size_t) (size - 1);
+		return input + 5;
+	}
+
+	if (size != PLC_R_SHM_DESC_SIZE || input[4] != PLC_R_SHM_TAG_REGION) {
+		raise_execution_error("Malformed bytea value of %d bytes on the shared memory channel", size);
+		*len = 0;
+		return input + 4;
+	}
+
+	memcpy(&offset, input + 5, sizeof(offset));
+	memcpy(&length, input + 13, sizeof(length));
+	if (offset > shm_half || length > shm_half - offset) {
+		raise_execution_error("Shared memory value at offset %lu of %lu bytes is out of bounds",
+		                      (unsigned long) offset, (unsigned long) length);
+		*len = 0;
+		return input + 4;
+	}
+
+	*len = (size_t) length;
+	return shm_base + offset;
+}
@@ -0,0 +1,50 @@
+/*------------------------------------------------------------------------------
+ *
+ * Copyright (c) 2016-Present Pivotal Software, Inc
+ *
+ *------------------------------------------------------------------------------
+ */
+#ifndef PLC_RSHM_H
+#define PLC_RSHM_H
+
+#include <stddef.h>
+
+#include "common/comm_connectivity.h"
+
+/*
+ * Shared memory side channel for large bytea values. A backend that supports
+ * it creates a file-backed region and offers it as its first message. The
+ * first half carries values sent by the backend, the second half values sent
+ * by the client.
+ *
+ * Once the offer is accepted every bytea value on the connection starts with
+ * a tag byte: PLC_R_SHM_TAG_INLINE followed by the payload, or
+ * PLC_R_SHM_TAG_REGION followed by the offset of the payload in the half of
+ * the sender and its length, both as 64-bit integers.
+ */
+#define PLC_R_SHM_TAG_INLINE 0
+#define PLC_R_SHM_TAG_REGION 1
+#define PLC_R_SHM_DESC_SIZE  17
+
+// Serve the first message of the backend, accepting the region it offers. Returns -1 if the connection failed
+int plc_r_shm_negotiate(plcConn *conn);
+
+// Start a new outgoing message, the previous one has been consumed by the backend
+void plc_r_shm_reset(void);
+
+// Room for an outgoing value of len bytes, NULL if it goes inline
+char *plc_r_shm_alloc(size_t len);
+
+// Start and size of the free outgoing memory, where plc_r_shm_alloc hands out next; NULL if there is none
+char *plc_r_shm_free_space(size_t *len);
+
+// The bytea descriptor of a value written to the memory from plc_r_shm_alloc
+char *plc_r_shm_descriptor(char *data, size_t len);
+
+// An inline bytea of len payload bytes with the framing of the connection, the payload goes to *payload. NULL if it is too large
+char *plc_r_shm_inline(size_t len, char **payload);
+
+// Payload of an incoming bytea value, read from the region if it is a descriptor
+char *plc_r_shm_resolve(char *input, size_t *len);
+
+#endif /* PLC_RSHM_H */
@@ -0,0 +1,231 @@
+/*------------------------------------------------------------------------------
+ *
+ * Copyright (c) 2016-Present Pivotal Software, Inc
+ *
+ *------------------------------------------------------------------------------
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <R.h>
+#include <Rinternals.h>
+#include <Rdefines.h>
+
+#include "common/comm_utils.h"
+#include "rarena.h"
+#include "rstats.h"
+
+/*
+ * Phase times are kept in histograms with log2 buckets of microseconds,
+ * bucket b counts times below 2^b us. p50/p99 report the bucket bound,
+ * so recording a call is a few additions and no allocation.
+ */
+#define STATS_BUCKETS 40
+
+typedef struct plcRPhaseStats {
+	double total_ms;
+	uint32 buckets[STATS_BUCKETS];
+} plcRPhaseStats;
+
+struct plcRFunctionStats {
+	unsigned int objectid;
+	char *name;
+	double calls;
+	double errors;
+	double bytes_in;
+	double bytes_out;
+	double compile_ms;
+	plcRPhaseStats phases[PLC_R_NPHASES];
+	struct plcRFunctionStats *next;
+};
+
+static const char *phase_names[PLC_R_NPHASES] = {"parse", "args", "eval", "convert", "send", "spi"};
+
+static plcRFunctionStats *function_stats = NULL;
+static int function_stats_count = 0;
+
+plcRFunctionStats *plc_r_stats_get(unsigned int objectid, const char *name) {
+	plcRFunctionStats *stats;
+
+	for (stats = function_stats; stats != NULL; stats = stats->next) {
+		if (stats->objectid == objectid && strcmp(stats->name, name) == 0) {
+			return stats;
+		}
+	}
+
+	stats = (plcRFunctionStats *) calloc(1, sizeof(plcRFunctionStats));
+	stats->objectid = objectid;
+	stats->name = strdup(name);
+	stats->next = function_stats;
+	function_stats = stats;
+	function_stats_count++;
+
+	return stats;
+}
+
+static int phase_bucket(double ms) {
+	unsigned long long us = (ms <= 0) ? 0 : (unsigned long long) (ms * 1000.0);
+	int bucket = 0;
+
+	while (us > 0 && bucket < STATS_BUCKETS - 1) {
+		us >>= 1;
+		bucket++;
+	}
+	return bucket;
+}
+
+void plc_r_stats_record(plcRFunctionStats *stats, plcRCallStats *call) {
+	int i;
+
+	stats->calls += 1;
+	if (call->failed) {
+		stats->errors += 1;
+	}
+	stats->bytes_in += call->bytes_in;
+	stats->bytes_out += call->bytes_out;
+	stats->compile_ms += call->compile_ms;
+	for (i = 0; i < PLC_R_NPHASES; i++) {
+		stats->phases[i].total_ms += call->phase_ms[i];
+		stats->phases[i].buckets[phase_bucket(call->phase_ms[i])]++;
+	}
+}
+
+static double phase_percentile(plcRFunctionStats *stats, int phase, double q) {
+	double seen = 0;
+	int b;
+
+	for (b = 0; b < STATS_BUCKETS; b++) {
+		seen += stats->phases[phase].buckets[b];
+		if (seen >= q * stats->calls) {
+			return (double) (1ULL << b) / 1000.0;
+		}
+	}
+	return (double) (1ULL << (STATS_BUCKETS - 1)) / 1000.0;
+}
+
+/*
+ * Text is not measured here, walking every string of a large text array on
+ * each call would cost as much as converting it. The conversion counts it,
+ * see plc_r_text_bytes_converted.
+ */
+static size_t value_bytes(plcType *type, char *value) {
+	switch (type->type) {
+		case PLC_DATA_TEXT:
+			return 0;
+		case PLC_DATA_BYTEA:
+			return *((int *) value) + 4;
+		case PLC_DATA_ARRAY: {
+			plcArray *arr = (plcArray *) value;
+			size_t bytes = arr->meta->size;
+
+			if (arr->meta->type == PLC_DATA_TEXT) {
+				return bytes;
+			}
+			return bytes * (plc_get_type_length(arr->meta->type) + 1);
+		}
+		case PLC_DATA_UDT: {
+			plcUDT *udt = (plcUDT *) value;
+			size_t bytes = 0;
+			int i;
+
+			for (i = 0; i < type->nSubTypes; i++) {
+				if (!udt->data[i].isnull) {
+					bytes += value_bytes(&type->subTypes[i], udt->data[i].value);
+				}
+			}
+			return bytes;
+		}
+		default:
+			return plc_get_type_length(type->type);
+	}
+}
+
+size_t plc_r_stats_arg_bytes(plcMsgCallreq *req) {
+	size_t bytes = 0;
+	int i;
+
+	for (i = 0; i < req->nargs; i++) {
+		if (!req->args[i].data.isnull && req->args[i].data.value != NULL) {
+			bytes += value_bytes(&req->args[i].type, req->args[i].data.value);
+		}
+	}
+	return bytes;
+}
+
+void plc_r_stats_log(void) {
+	plcRFunctionStats *stats;
+
+	for (stats = function_stats; stats != NULL; stats = stats->next) {
+		char line[1024];
+		int len, i;
+
+		len = snprintf(line, sizeof(line), "R function %s (%u): calls %.0f, errors %.0f, bytes in %.0f, out %.0f"
+		               ", compile %.3f ms",
+		               stats->name, stats->objectid, stats->calls, stats->errors,
+		               stats->bytes_in, stats->bytes_out, stats->compile_ms);
+		for (i = 0; i < PLC_R_NPHASES && len > 0 && (size_t) len < sizeof(line); i++) {
+			len += snprintf(line + len, sizeof(line) - len, ", %s total %.3f p50 %.3f p99 %.3f ms",
+			                phase_names[i], stats->phases[i].total_ms,
+			                phase_percentile(stats, i, 0.5), phase_percentile(stats, i, 0.99));
+		}
+		plc_elog(LOG, "%s", line);
+	}
+
+	plc_elog(LOG, "R client conversion arena high-water mark %zu bytes", plc_r_arena_high_water());
+}
+
+SEXP plr_stats(void) {
+	plcRFunctionStats *stats;
+	SEXP res, names, row_names;
+	int ncols = 6 + 3 * PLC_R_NPHASES;
+	int row, col, i;
+	char name[64];
+
+	PROTECT(res = NEW_LIST(ncols));
+	PROTECT(names = NEW_CHARACTER(ncols));
+
+	SET_VECTOR_ELT(res, 0, NEW_CHARACTER(function_stats_count));
+	SET_STRING_ELT(names, 0, mkChar("function"));
+	SET_STRING_ELT(names, 1, mkChar("calls"));
+	SET_STRING_ELT(names, 2, mkChar("errors"));
+	SET_STRING_ELT(names, 3, mkChar("bytes_in"));
+	SET_STRING_ELT(names, 4, mkChar("bytes_out"));
+	SET_STRING_ELT(names, 5, mkChar("compile_ms"));
+	for (i = 0; i < PLC_R_NPHASES; i++) {
+		snprintf(name, sizeof(name), "%s_total_ms", phase_names[i]);
+		SET_STRING_ELT(names, 6 + 3 * i, mkChar(name));
+		snprintf(name, sizeof(name), "%s_p50_ms", phase_names[i]);
+		SET_STRING_ELT(names, 7 + 3 * i, mkChar(name));
+		snprintf(name, sizeof(name), "%s_p99_ms", phase_names[i]);
+		SET_STRING_ELT(names, 8 + 3 * i, mkChar(name));
+	}
+	for (col = 1; col < ncols; col++) {
+		SET_VECTOR_ELT(res, col, NEW_NUMERIC(function_stats_count));
+	}
+
+	for (stats = function_stats, row = 0; stats != NULL; stats = stats->next, row++) {
+		SET_STRING_ELT(VECTOR_ELT(res, 0), row, mkChar(stats->name));
+		NUMERIC_DATA(VECTOR_ELT(res, 1))[row] = stats->calls;
+		NUMERIC_DATA(VECTOR_ELT(res, 2))[row] = stats->errors;
+		NUMERIC_DATA(VECTOR_ELT(res, 3))[row] = stats->bytes_in;
+		NUMERIC_DATA(VECTOR_ELT(res, 4))[row] = stats->bytes_out;
+		NUMERIC_DATA(VECTOR_ELT(res, 5))[row] = stats->compile_ms;
+		for (i = 0; i < PLC_R_NPHASES; i++) {
+			NUMERIC_DATA(VECTOR_ELT(res, 6 + 3 * i))[row] = stats->phases[i].total_ms;
+			NUMERIC_DATA(VECTOR_ELT(res, 7 + 3 * i))[row] = phase_percentile(stats, i, 0.5);
+			NUMERIC_DATA(VECTOR_ELT(res, 8 + 3 * i))[row] = phase_percentile(stats, i, 0.99);
+		}
+	}
+
+	setAttrib(res, R_NamesSymbol, names);
+
+	PROTECT(row_names = allocVector(INTSXP, 2));
+	INTEGER(row_names)[0] = NA_INTEGER;
+	INTEGER(row_names)[1] = -function_stats_count;
+	setAttrib(res, R_RowNamesSymbol, row_names);
+	setAttrib(res, R_ClassSymbol, mkString("data.frame"));
+
+	UNPROTECT(3);
+	return res;
+}
@@ -0,0 +1,52 @@
+/*------------------------------------------------------------------------------
+ *
+ * Copyright (c) 2016-Present Pivotal Software, Inc
+ *
+ *------------------------------------------------------------------------------
+ */
+#ifndef PLC_RSTATS_H
+#define PLC_RSTATS_H
+
+#include <R.h>
+#include <Rinternals.h>
+
+#include "common/messages/messages.h"
+
+/* Phases of a call, their times add up to the time spent in handle_call */
+typedef enum plcRPhase {
+	PLC_R_PHASE_PARSE = 0,  /* wrapper creation, parse and compile on cache miss */
+	PLC_R_PHASE_ARGS,       /* arguments_to_r */
+	PLC_R_PHASE_EVAL,       /* R_tryEval, without the SPI round trips */
+	PLC_R_PHASE_CONVERT,    /* result conversion */
+	PLC_R_PHASE_SEND,       /* channel send of the result */
+	PLC_R_PHASE_SPI,        /* waiting for SPI results */
+	PLC_R_NPHASES
+} plcRPhase;
+
+/* Measurements of one call */
+typedef struct plcRCallStats {
+	double phase_ms[PLC_R_NPHASES];
+	size_t bytes_in;
+	size_t bytes_out;
+	double compile_ms;      /* byte-compilation on a cache miss, part of the parse phase */
+	bool failed;
+} plcRCallStats;
+
+typedef struct plcRFunctionStats plcRFunctionStats;
+
+// Statistics of a function, created on first use and kept for the client lifetime
+plcRFunctionStats *plc_r_stats_get(unsigned int objectid, const char *name);
+
+// Add the measurements of a completed call
+void plc_r_stats_record(plcRFunctionStats *stats, plcRCallStats *call);
+
+// Size of the non-text argument payload of a call request, text is counted by the conversion
+size_t plc_r_stats_arg_bytes(plcMsgCallreq *req);
+
+// Log one line per function with its aggregated statistics, and the arena high-water mark
+void plc_r_stats_log(void);
+
+// R interface, the statistics as a data.frame with one row per function
+SEXP plr_stats(void);
+
+#endif /* PLC_RSTATS_H */